@@ -151,6 +151,7 @@ typedef struct {
 #define MADT_TYPE_IOAPIC    1
 #define MADT_TYPE_INTSRC    2
 #define MADT_TYPE_LAPIC_NMI 4
+#define MADT_TYPE_X2APIC    9
 
 /*
 static char *madt_type[] = {
@@ -185,6 +186,18 @@ typedef struct {
     } flags;
 } __attribute__((packed)) madt_lapic_t;
 
+/* Processor Local x2APIC (ACPI 4.0: used for APIC IDs >= 255) */
+typedef struct {
+    madt_hdr_t header;
+    uint16_t reserved;
+    uint32_t x2apic_id;
+    struct {
+        uint32_t enabled     : 1;
+        uint32_t reserved    : 31;
+    } flags;
+    uint32_t acpi_processor_uid;
+} __attribute__((packed)) madt_x2apic_t;
+
 typedef struct {
     madt_hdr_t header;
     uint8_t ioapic_id;
@@ -64,30 +64,62 @@
 #define LAPIC_LVT_ERROR     0x0370
 #define LAPIC_ICR_LOW       0x0300
 #define LAPIC_ICR_HIGH      0x0310
+#define LAPIC_TIMER_INIT    0x0380
+#define LAPIC_TIMER_CUR     0x0390
+#define LAPIC_TIMER_DIV     0x03E0
+
+/*
+ * x2APIC mode: the registers are MSRs (0x800 + offset/16), the ICR is one 64 bit MSR
+ * (destination in bits 63:32) and the ID register holds the full 32 bit APIC ID.
+ */
+#define LAPIC_BASE_EXTD     (1u << 10)  /* MSR_APIC_BASE: x2APIC mode */
+#define LAPIC_BASE_EN       (1u << 11)  /* MSR_APIC_BASE: global enable */
+#define X2APIC_MSR(offset)  (0x800 + ((offset) >> 4))
 
 static ptr_t localAPIC =   0xfee00000UL;
 static ptr_t ioAPIC_base = 0xfec00000UL;
+static unsigned x2apic_mode = 0;    /* set by the BSP in apic_init() */
 
 volatile unsigned cpu_online = 0;
 
+static void apic_timer_calibrate(void);
+
 uint32_t read_localAPIC(uint32_t offset)
 {
+    if (x2apic_mode) return (uint32_t)rdmsr(X2APIC_MSR(offset));
     volatile uint32_t *localAPIC_Register = (uint32_t*)(localAPIC+offset);
     return *localAPIC_Register;
 }
 void write_localAPIC(uint32_t offset, uint32_t value)
 {
+    if (x2apic_mode) {
+        wrmsr(X2APIC_MSR(offset), value);
+        return;
+    }
     volatile uint32_t *localAPIC_Register = (uint32_t*)(localAPIC+offset);
     //IFVV printf("write_localAPIC: 0x%x  -> 0x%x\n", (ptr_t)localAPIC_Register, value);
     *localAPIC_Register = value;
 }
 void set_localAPIC(uint32_t offset, uint32_t mask, uint32_t value)
 {
-    volatile uint32_t *localAPIC_Register = (uint32_t*)(localAPIC+offset);
-    uint32_t reg = *localAPIC_Register;
+    uint32_t reg = read_localAPIC(offset);
     reg &= ~mask;
     reg |= value;
-    *localAPIC_Register = reg;
+    write_localAPIC(offset, reg);
+}
+
+/*
+ * write the interrupt command register (low: command, dest: APIC ID)
+ * xAPIC: two writes (the write to the low half sends the IPI), x2APIC: one write
+ */
+static void write_icr(uint32_t dest, uint32_t low)
+{
+    if (x2apic_mode) {
+        wrmsr(X2APIC_MSR(LAPIC_ICR_LOW), ((uint64_t)dest << 32) | low);
+    } else {
+        write_localAPIC(LAPIC_ICR_HIGH, dest << 24);
+        write_localAPIC(LAPIC_ICR_LOW, low);
+    }
 }
 
 uint32_t read_ioAPIC(unsigned id, uint32_t offset)
@@ -134,8 +166,11 @@ void write_ioAPIC(unsigned id, uint32_t offset, uint32_t value)
 #define ICR_LVL_ASSERT          (1u <<14)
 #define ICR_DLV_STATUS          (1u <<12)
 #define ICR_MODE_FIXED          (0u <<8)
+#define ICR_MODE_INIT           (5u <<8)
+#define ICR_MODE_STARTUP        (6u <<8)
+#define ICR_ALL_EXCL_SELF       (3u <<18)   /* destination shorthand */
 
-void send_ipi(uint8_t to, uint8_t vector)
+void send_ipi(unsigned to, uint8_t vector)
 {
     uint32_t value;
     unsigned if_backup;
@@ -144,10 +179,6 @@ void send_ipi(uint8_t to, uint8_t vector)
 
     IFVV printf("send_ipi()  to: %u  lapic_id: %u  vector: %u\n", 
             (unsigned long)to, (unsigned long)hw_info.cpu[to].lapic_id, (unsigned long)vector);
-    value = read_localAPIC(LAPIC_ICR_HIGH);
-    value &= 0x00FFFFFF;
-    value |= ((uint32_t)hw_info.cpu[to].lapic_id << 24);
-    write_localAPIC(LAPIC_ICR_HIGH, value);
 
     /*
     value = (0u << 18)   // Destination Shorthand: 00 - No Shorthand
@@ -158,8 +189,9 @@ void send_ipi(uint8_t to, uint8_t vector)
             |(0u << 8)   // Delivery Mode: 000 - Fixed
             |vector;
             */
-    value = ICR_LVL_ASSERT | ICR_DLV_STATUS | ICR_MODE_FIXED | vector;
-    write_localAPIC(LAPIC_ICR_LOW, value);
+    value = ICR_LVL_ASSERT | ICR_MODE_FIXED | vector;
+    if (!x2apic_mode) value |= ICR_DLV_STATUS;      /* reserved in x2APIC mode (#GP) */
+    write_icr(hw_info.cpu[to].lapic_id, value);
     if (if_backup) sti();
 }
 
@@ -169,10 +201,13 @@ void apic_eoi(void)
     write_localAPIC(LAPIC_REG_EOI, 0);
 }
 
-extern stack_t stack[MAX_CPU];
-
 void config_apic(unsigned id)
 {
+    if (x2apic_mode) {
+        /* switch to x2APIC mode (xAPIC must be enabled first, both bits may be set at once) */
+        wrmsr(LAPIC_MSR_APIC_BASE, rdmsr(LAPIC_MSR_APIC_BASE) | LAPIC_BASE_EN | LAPIC_BASE_EXTD);
+    }
+
     /* To initialise the BSP's local APIC, set the enable bit in the spurious
      * interrupt vector register and set the error interrupt vector in the
      * local vector table.  */
@@ -180,12 +215,11 @@ void config_apic(unsigned id)
     set_localAPIC(LAPIC_REG_SPURIOUS, 0xFF, 0xA0);
 
 
-    if (id > 0) {
-        /*
-         * is this needed?!
-         */
-        write_localAPIC(LAPIC_REG_ID, (id&0x7F)<<24);
-    }
+    /*
+     * The APIC ID is left as it is: hw_info.cpu[id] records it (see apic_set_cpu()), 
+     * with the parallel startup, the AP numbers are not in the order of the MADT.
+     */
+    (void)id;
 
     /*
      * according to http://www.osdever.net/tutorials/view/multiprocessing-support-for-hobby-oses-explained
@@ -197,6 +231,8 @@ void config_apic(unsigned id)
      * deactivate (mask) all LVT entries (except ERROR)
      */
     set_localAPIC(LAPIC_LVT_TIMER, 1<<16, 1<<16);
+    set_localAPIC(LAPIC_LVT_TIMER, 0xFF, TIMER_VECTOR);
+    write_localAPIC(LAPIC_TIMER_DIV, 0xB);              /* timer: divide by 1 (see apic_timer_*()) */
     //set_localAPIC(LAPIC_LVT_CMCI, 1<<16, 1<<16);
     //set_localAPIC(LAPIC_LVT_CMCI, 0xFF, 0xA3);
 
@@ -216,6 +252,17 @@ void config_apic(unsigned id)
 
 }
 
+/* 
+ * record the APIC ID of the calling CPU (number id) in hw_info.cpu[id] and decode its topology
+ */
+static void apic_set_cpu(unsigned id)
+{
+    uint32_t lapic_id = read_localAPIC(LAPIC_REG_ID);
+
+    if (!x2apic_mode) lapic_id >>= 24;
+    topo_init_cpu(id, lapic_id);
+}
+
 void apic_init()
 {
     uint16_t u;
@@ -225,6 +272,8 @@ void apic_init()
 
     /* local APIC address is in hw_info */
     localAPIC = hw_info.lapic_adr;
+    x2apic_mode = (X2APIC && hw_info.cpuid_x2apic);
+    IFV printf("local APIC in %s mode\n", x2apic_mode ? "x2APIC" : "xAPIC");
 
 
     /* support only VERSION >= 0x10 */
@@ -243,6 +292,8 @@ void apic_init()
 
     /* Presence: CPUID.01h:EDX[bit 9] (checked already in start.asm) */
     config_apic(0);
+    apic_set_cpu(0);
+    apic_timer_calibrate();
 
     IFVV printf("local APIC version: 0x%x  max LVT entry: %u\n", 
             read_localAPIC(LAPIC_REG_VERSION) && 0xFF, 
@@ -257,12 +308,19 @@ void apic_init()
     uint8_t *ptr = (uint8_t*)(ptr_t)(SMP_FRAME << 12);
 
     extern uint8_t smp_start[];
-    extern uint16_t smp_apid;
+    extern uint16_t smp_scol;
+    extern uint32_t smp_stack;
+    extern uint32_t smp_next;
+    extern uint32_t smp_cnt;
     extern uint8_t smp_end;
     uint16_t size = (uint16_t)((ptr_t)&smp_end - (ptr_t)&smp_start);
 
-    /* pointer to the variable smp_apid in that page */
-    volatile uint16_t *ptr_apid = (void*)ptr + ((ptr_t)&smp_apid - (ptr_t)&smp_start);
+    /* pointers to the shared variables in that page */
+    volatile uint16_t *ptr_scol = (void*)ptr + ((ptr_t)&smp_scol - (ptr_t)&smp_start);
+    volatile uint32_t *ptr_stack = (void*)ptr + ((ptr_t)&smp_stack - (ptr_t)&smp_start);
+    volatile uint32_t *ptr_next = (void*)ptr + ((ptr_t)&smp_next - (ptr_t)&smp_start);
+    volatile uint32_t *ptr_cnt = (void*)ptr + ((ptr_t)&smp_cnt - (ptr_t)&smp_start);
+    unsigned cnt = smp_cpu_cnt();
 
     IFVV printf("smp_start = 0x%x  smp_end = 0x%x  size = %u\n", (ptr_t)&smp_start, (ptr_t)&smp_end, size);
 
@@ -282,46 +340,93 @@ void apic_init()
     /* set up status monitor for APs */
     status_putch(5, '[');
     status_putch(6, STATUS_RUNNING);
-    status_putch(6+hw_info.cpu_cnt, ']');
+    status_putch(6+smp_status_cols(), ']');
+
+    if (cnt < 2 || cpu_stack[1] == 0) return;   /* no APs (or no stacks for them) */
+    *ptr_stack = (uint32_t)(ptr_t)(cpu_stack[1] + 1);     /* stack grows downwards from the end */
+
+#if SMP_STARTUP == 1
+    /*
+     * broadcast: all APs start at once and claim the numbers 1 .. cnt-1 (the others halt)
+     * The APs take their place in hw_info.cpu[] in main_ap() (APIC ID and topology).
+     */
+    uint64_t tsc, timeout;
+
+    for (u = 1; u < cnt; u++) status_putch(smp_status_col(u), STATUS_WAKEUP);
+    *ptr_scol = 4;              /* the APs' early marks (all in one column) */
+    *ptr_next = 1;
+    *ptr_cnt = cnt;
+    IFV printf("SMP: broadcast INIT-SIPI-SIPI for %u APs\n", cnt-1);
 
-    /* now send IPIs to the APs */
+    write_icr(0, ICR_ALL_EXCL_SELF | ICR_MODE_INIT | SMP_FRAME);
+    udelay(10*1000); /* 10 ms */
+    write_icr(0, ICR_ALL_EXCL_SELF | ICR_MODE_STARTUP | SMP_FRAME);
+    udelay(200);  /* 200 us */
+    write_icr(0, ICR_ALL_EXCL_SELF | ICR_MODE_STARTUP | SMP_FRAME);
+
+    /* wait until all numbers are claimed (or 100 ms) */
+    tsc = rdtsc();
+    timeout = tsc + 100*1000*(uint64_t)hw_info.tsc_per_usec;
+    while (*ptr_next < cnt && rdtsc() < timeout) pause();
+
+    /* 
+     * late APs must not join anymore: close the counter, then wait for the ones that claimed a number 
+     * (or another 100 ms: an AP may fault before main_ap(), smp_close() gives up on it)
+     */
+    u = __sync_lock_test_and_set(ptr_next, cnt);
+    if (u > cnt) u = cnt;
+    timeout = rdtsc() + 100*1000*(uint64_t)hw_info.tsc_per_usec;
+    while (cpu_online < (unsigned)(u-1) && rdtsc() < timeout) pause();
+    IFV printf("SMP: %u of %u APs up after %u us\n", (unsigned long)cpu_online, cnt-1, 
+            (unsigned long)((rdtsc() - tsc) / hw_info.tsc_per_usec));
+#else
+    extern uint16_t smp_apid;
+    volatile uint16_t *ptr_apid = (void*)ptr + ((ptr_t)&smp_apid - (ptr_t)&smp_start);
+
+    /* now send IPIs to the APs (the cmdline's cpumask only covers the first 32 CPUs) */
     for (u = 1; u < hw_info.cpu_cnt; u++) {
-        if (u >= hw_info.cmd_maxcpu || ((hw_info.cmd_cpumask & (1 << u)) == 0)) {
-            status_putch(6+u, STATUS_NOTUP);
+        if (cpu_stack[u] == 0) continue;
+        if (u < 32 && (hw_info.cmd_cpumask & (1u << u)) == 0) {
+            cpu_stack[u]->info.join = SMP_JOIN_LATE;    /* not started, smp_close() skips it */
+            status_putch(smp_status_col(u), STATUS_NOTUP);
             IFV printf("SMP: skip AP#%u\n", u);
             continue;
         }
-        status_putch(6+u, STATUS_WAKEUP);
+        if (!x2apic_mode && hw_info.cpu[u].lapic_id > 0xFF) {
+            cpu_stack[u]->info.join = SMP_JOIN_LATE;
+            status_putch(smp_status_col(u), STATUS_NOTUP);
+            printf("SMP: AP#%u has APIC ID %u (needs x2APIC mode)\n", u, hw_info.cpu[u].lapic_id);
+            continue;
+        }
+        status_putch(smp_status_col(u), STATUS_WAKEUP);
         *ptr_apid = u;
+        *ptr_scol = smp_status_col(u);
+        *ptr_next = u;          /* this AP gets number u (and cpu_stack[u]) */
+        *ptr_cnt = u+1;
         IFV printf("SMP: try to wake up AP#%u\n", u);
         IFVV printf("  #%u: send INIT IPI\n", u);
-        write_localAPIC(LAPIC_ICR_HIGH, (uint32_t)hw_info.cpu[u].lapic_id<<24);
-        write_localAPIC(LAPIC_ICR_LOW,  (uint32_t)   (0x5 << 8)|SMP_FRAME);
+        write_icr(hw_info.cpu[u].lapic_id, ICR_MODE_INIT | SMP_FRAME);
 
         udelay(10*1000); /* 10 ms */
         
         IFVV printf("  #%u: send first SIPI\n", u);
-        write_localAPIC(LAPIC_ICR_HIGH, (uint32_t)hw_info.cpu[u].lapic_id<<24);
-        write_localAPIC(LAPIC_ICR_LOW,  (uint32_t)   (0x6 << 8)|SMP_FRAME);
+        write_icr(hw_info.cpu[u].lapic_id, ICR_MODE_STARTUP | SMP_FRAME);
 
         udelay(200);  /* 200 us */
         
         IFVV printf("  #%u: send second SIPI\n", u);
-        write_localAPIC(LAPIC_ICR_HIGH, (uint32_t)hw_info.cpu[u].lapic_id<<24);
-        write_localAPIC(LAPIC_ICR_LOW,  (uint32_t)   (0x6 << 8)|SMP_FRAME);
+        write_icr(hw_info.cpu[u].lapic_id, ICR_MODE_STARTUP | SMP_FRAME);
 
         udelay(100 * 1000); /* 100 ms */
-        if (mutex_trylock(&(stack[u].info.wakelock))) {
-            /*
-             * lock obtained successfully => AP did not lock it in time 
-             * if we lock the wakelock, the AP will block in main_ap()
-             */
+        if (__sync_bool_compare_and_swap(&(cpu_stack[u]->info.join), SMP_JOIN_WAIT, SMP_JOIN_LATE)) {
+            /* AP did not join in time: it will halt in main_ap() */
             printf("  #%u: CPU did not come up.\n", u);
         }
         
     }
-
-    udelay(100*1000);
+#endif
+    /* give up on the missing APs, renumber the others densely (before anybody uses the IDs) */
+    smp_close(cnt);
     IFV printf("all %u APs called, %u up\n", hw_info.cpu_cnt-1, cpu_online);
 
 
@@ -340,6 +445,7 @@ void apic_init_ap(unsigned id)
 
     /* Presence: CPUID.01h:EDX[bit 9] (checked already in start.asm) */
     config_apic(id);
+    apic_set_cpu(id);
 
     IFVV printf("local APIC version: 0x%x  max LVT entry: %u\n", 
             read_localAPIC(LAPIC_REG_VERSION) && 0xFF, 
@@ -347,6 +453,258 @@ void apic_init_ap(unsigned id)
 }
 
 
+/*
+ * local APIC timer
+ * It counts down with the bus clock (divide by 1, calibrated against the TSC by the BSP).
+ *  - periodic: an interrupt every period
+ *  - one-shot: one interrupt when the count reaches 0 (TSC values are converted to timer ticks)
+ *  - TSC-deadline: one interrupt when the TSC reaches IA32_TSC_DEADLINE (CPUID.01h:ECX[bit 24])
+ * The interrupt (TIMER_VECTOR) calls timer_interrupt() (time.c).
+ */
+#define LVT_MASKED          (1u << 16)
+#define LVT_TIMER_ONESHOT   (0u << 17)
+#define LVT_TIMER_PERIODIC  (1u << 17)
+#define LVT_TIMER_DEADLINE  (2u << 17)
+#define MSR_TSC_DEADLINE    0x6E0
+
+static cpumask_t irq_isolated = {{ 0 }};    /* CPUs in irq_isolate() */
+
+static uint32_t timer_ticks_per_ms = 0;     /* 0: not calibrated */
+static unsigned timer_has_deadline = 0;
+
+static void apic_timer_calibrate(void)
+{
+    uint32_t ticks;
+
+    timer_has_deadline = IS_BIT_SET(cpuid_ecx(1), 24);
+    write_localAPIC(LAPIC_LVT_TIMER, LVT_MASKED | LVT_TIMER_ONESHOT | TIMER_VECTOR);
+    write_localAPIC(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    udelay(10*1000);    /* 10 ms */
+    ticks = 0xFFFFFFFF - read_localAPIC(LAPIC_TIMER_CUR);
+    write_localAPIC(LAPIC_TIMER_INIT, 0);
+    timer_ticks_per_ms = ticks / 10;
+    IFV printf("APIC timer: %u ticks/ms, TSC-deadline mode %ssupported\n", 
+            (unsigned long)timer_ticks_per_ms, timer_has_deadline ? "" : "not ");
+}
+
+/* TSC cycles to timer ticks (rounded up, at least 1) */
+static uint32_t timer_ticks(uint64_t cycles)
+{
+    uint64_t tsc_per_ms = (uint64_t)hw_info.tsc_per_usec * 1000;
+    uint64_t t = (cycles * timer_ticks_per_ms + tsc_per_ms - 1) / tsc_per_ms;
+    if (t == 0) t = 1;
+    if (t > 0xFFFFFFFF) t = 0xFFFFFFFF;     /* timer_interrupt() re-arms, if too early */
+    return (uint32_t)t;
+}
+
+/* the timer of an isolated CPU stays masked */
+static uint32_t timer_masked(void)
+{
+    return cpumask_test(&irq_isolated, CPU_ID) ? LVT_MASKED : 0;
+}
+
+int apic_timer_ok(void)
+{
+    return timer_ticks_per_ms != 0;
+}
+
+int apic_timer_has_deadline(void)
+{
+    return timer_has_deadline;
+}
+
+void apic_timer_periodic(unsigned long us)
+{
+    write_localAPIC(LAPIC_LVT_TIMER, timer_masked() | LVT_TIMER_PERIODIC | TIMER_VECTOR);
+    write_localAPIC(LAPIC_TIMER_INIT, timer_ticks((uint64_t)us * hw_info.tsc_per_usec));
+}
+
+void apic_timer_oneshot(unsigned long us)
+{
+    write_localAPIC(LAPIC_LVT_TIMER, timer_masked() | LVT_TIMER_ONESHOT | TIMER_VECTOR);
+    write_localAPIC(LAPIC_TIMER_INIT, timer_ticks((uint64_t)us * hw_info.tsc_per_usec));
+}
+
+void apic_timer_at(uint64_t tsc, unsigned deadline_mode)
+{
+    uint64_t now;
+
+    if (deadline_mode && timer_has_deadline) {
+        write_localAPIC(LAPIC_LVT_TIMER, timer_masked() | LVT_TIMER_DEADLINE | TIMER_VECTOR);
+        mfence();       /* the LVT write (xAPIC: MMIO) must be done before the WRMSR */
+        wrmsr(MSR_TSC_DEADLINE, tsc ? tsc : 1);     /* 0 would disarm */
+    } else {
+        now = rdtsc();
+        write_localAPIC(LAPIC_LVT_TIMER, timer_masked() | LVT_TIMER_ONESHOT | TIMER_VECTOR);
+        write_localAPIC(LAPIC_TIMER_INIT, timer_ticks(tsc > now ? tsc - now : 0));
+    }
+}
+
+void apic_timer_stop(void)
+{
+    write_localAPIC(LAPIC_LVT_TIMER, LVT_MASKED | LVT_TIMER_ONESHOT | TIMER_VECTOR);
+    write_localAPIC(LAPIC_TIMER_INIT, 0);
+}
+
+
+/*
+ * I/O APIC redirection entries and the isolation profile (see apic.h)
+ * Entry n: low word at 0x10+2n (vector, mode, mask), high word at 0x11+2n (destination in bits 24-31).
+ */
+#define IOAPIC_REG_VERSION  0x01
+#define IOAPIC_REDIR_LO(n)  (0x10 + 2*(n))
+#define IOAPIC_REDIR_HI(n)  (0x11 + 2*(n))
+#define REDIR_MASKED        (1u << 16)
+#define REDIR_LEVEL         (1u << 15)
+#define REDIR_ACTIVE_LOW    (1u << 13)
+
+static const uint32_t lvt_regs[] = {    /* in the order of the LVT (max. LVT entry in LAPIC_REG_VERSION) */
+    LAPIC_LVT_TIMER, LAPIC_LVT_THERMAL, LAPIC_LVT_PERF, LAPIC_LVT_LINT0,
+    LAPIC_LVT_LINT1, LAPIC_LVT_ERROR, LAPIC_LVT_CMCI
+};
+static uint8_t lvt_unmasked[MAX_CPU] = { 0 };       /* bit u: lvt_regs[u] was unmasked before irq_isolate() */
+static uint8_t ioapic_dest[256] = { 0 };            /* destinations before irq_isolate() */
+
+unsigned irq_isa(unsigned isa_irq)
+{
+    return (isa_irq < 16) ? hw_info.isa_gsi[isa_irq] : isa_irq;
+}
+
+unsigned ioapic_pins(void)
+{
+    if (hw_info.ioapic_cnt == 0) return 0;
+    return ((read_ioAPIC(0, IOAPIC_REG_VERSION) >> 16) & 0xFF) + 1;
+}
+
+/* polarity and trigger mode: ISA (edge, active high) unless overridden, PCI (level, active low) */
+static uint32_t redir_mode(unsigned irq)
+{
+    unsigned u, flags;
+    uint32_t mode = 0;
+
+    for (u = 0; u < 16; u++) {
+        if (hw_info.isa_gsi[u] == irq) {
+            flags = hw_info.isa_flags[u];
+            if ((flags & 3) == 3) mode |= REDIR_ACTIVE_LOW;
+            if (((flags >> 2) & 3) == 3) mode |= REDIR_LEVEL;
+            return mode;
+        }
+    }
+    return (irq < 16) ? 0 : (REDIR_LEVEL | REDIR_ACTIVE_LOW);
+}
+
+int ioapic_route(unsigned irq, const cpumask_t *mask)
+{
+    cpumask_t targets;
+    unsigned cpu, n;
+    uint32_t dest;
+
+    if (irq >= ioapic_pins() || irq >= IRQ_VECTORS) return -1;
+
+    cpumask_fill(&targets, cpu_online);
+    cpumask_and(&targets, &targets, mask);
+    n = cpumask_weight(&targets);
+    if (n == 0) return -1;
+    cpu = cpumask_next(&targets, 0);
+    for (n = irq % n; n > 0; n--) cpu = cpumask_next(&targets, cpu+1);
+
+    /* physical destination mode: 8 bit APIC ID (larger IDs need interrupt remapping) */
+    dest = hw_info.cpu[cpu].lapic_id;
+    if (dest > 0xFE) return -1;
+
+    write_ioAPIC(0, IOAPIC_REDIR_LO(irq), REDIR_MASKED);
+    write_ioAPIC(0, IOAPIC_REDIR_HI(irq), dest << 24);
+    write_ioAPIC(0, IOAPIC_REDIR_LO(irq), redir_mode(irq) | (IRQ_VECTOR + irq));   /* fixed, physical */
+    IFV printf("IRQ %u -> CPU %u (APIC ID %u)\n", irq, cpu, dest);
+    return 0;
+}
+
+void ioapic_mask(unsigned irq, unsigned masked)
+{
+    uint32_t lo;
+
+    if (irq >= ioapic_pins()) return;
+    lo = read_ioAPIC(0, IOAPIC_REDIR_LO(irq));
+    write_ioAPIC(0, IOAPIC_REDIR_LO(irq), masked ? (lo | REDIR_MASKED) : (lo & ~REDIR_MASKED));
+}
+
+static void lvt_mask_call(void *arg)
+{
+    unsigned u, n = ((read_localAPIC(LAPIC_REG_VERSION) >> 16) & 0xFF) + 1;
+    unsigned bits = 0;
+
+    (void)arg;
+    if (n > sizeof(lvt_regs)/sizeof(lvt_regs[0])) n = sizeof(lvt_regs)/sizeof(lvt_regs[0]);
+    for (u = 0; u < n; u++) {
+        if (!(read_localAPIC(lvt_regs[u]) & LVT_MASKED)) {
+            bits |= 1u << u;
+            set_localAPIC(lvt_regs[u], LVT_MASKED, LVT_MASKED);
+        }
+    }
+    lvt_unmasked[CPU_ID] = bits;
+}
+
+static void lvt_unmask_call(void *arg)
+{
+    volatile cpu_info_t *info = my_cpu_info();
+    unsigned u, bits = lvt_unmasked[info->cpu_id];
+
+    (void)arg;
+    for (u = 0; bits != 0; u++, bits >>= 1) {
+        if (bits & 1) set_localAPIC(lvt_regs[u], LVT_MASKED, 0);
+    }
+    lvt_unmasked[info->cpu_id] = 0;
+    /* a one-shot timer expired while masked does not interrupt any more: re-arm */
+    if (info->timer_queue) apic_timer_at(info->timer_queue->deadline, APIC_TIMER_DEADLINE);
+}
+
+void irq_isolate(const cpumask_t *bench)
+{
+    unsigned u, pins = ioapic_pins();
+    uint32_t hi;
+
+    /* CPU 0 does the housekeeping: all device interrupts and its local ones */
+    cpumask_fill(&irq_isolated, cpu_online);
+    cpumask_and(&irq_isolated, &irq_isolated, bench);
+    cpumask_unset(&irq_isolated, 0);
+
+    for (u = 0; u < pins; u++) {
+        hi = read_ioAPIC(0, IOAPIC_REDIR_HI(u));
+        ioapic_dest[u] = hi >> 24;
+        write_ioAPIC(0, IOAPIC_REDIR_HI(u), (hi & 0x00FFFFFF) | (hw_info.cpu[0].lapic_id << 24));
+    }
+    smp_call_function_mask(&irq_isolated, lvt_mask_call, 0, 1);
+
+    /* from now on, the isolated CPUs should not count any interrupt */
+    cpumask_for_each(u, &irq_isolated) {
+        cpu_stack[u]->info.irq_mark = cpu_stack[u]->info.irq_cnt;
+    }
+}
+
+unsigned long irq_unisolate(void)
+{
+    unsigned u, pins = ioapic_pins();
+    unsigned long n, sum = 0;
+    uint32_t hi;
+    cpumask_t isolated = irq_isolated;
+
+    cpumask_for_each(u, &isolated) {
+        n = cpu_stack[u]->info.irq_cnt - cpu_stack[u]->info.irq_mark;
+        IFV if (n) printf("CPU %u: %u interrupts while isolated\n", u, n);
+        sum += n;
+    }
+
+    /* clear first: lvt_unmask_call() re-arms the timer */
+    cpumask_clear(&irq_isolated);
+    smp_call_function_mask(&isolated, lvt_unmask_call, 0, 1);
+    for (u = 0; u < pins; u++) {
+        hi = read_ioAPIC(0, IOAPIC_REDIR_HI(u));
+        write_ioAPIC(0, IOAPIC_REDIR_HI(u), (hi & 0x00FFFFFF) | ((uint32_t)ioapic_dest[u] << 24));
+    }
+    return sum;
+}
+
+
 /*
  * debug: print lapic values
  */
@@ -363,7 +721,11 @@ void print_apic(void)
             (ptr_t)(u64 & (((1ull<<(hw_info.maxphyaddr-12))-1)<<12)));
 
     u32 = read_localAPIC(LAPIC_REG_ID);
-    printf("[APIC %u] REG_ID     = 0x%08x\n", CPU_ID, u32>>24);
+    if (x2apic_mode) {
+        printf("[APIC %u] REG_ID     = 0x%08x (x2APIC)\n", CPU_ID, u32);
+    } else {
+        printf("[APIC %u] REG_ID     = 0x%08x\n", CPU_ID, u32>>24);
+    }
 
     u32 = read_localAPIC(LAPIC_REG_VERSION);
     max_lvt = ((u32>>16) & 0xFF) + 1;
@@ -375,8 +737,10 @@ void print_apic(void)
     u32 = read_localAPIC(LAPIC_LVT_TIMER);
     printf("[APIC %u] LVT_TIMER  = 0x%08x mask=%u vector=%03u\n", CPU_ID, u32, (u32>>16)&1, u32&0xFF);
 
-    u32 = read_localAPIC(LAPIC_LVT_CMCI);
-    printf("[APIC %u] LVT_CMCI   = 0x%08x mask=%u vector=%03u\n", CPU_ID, u32, (u32>>16)&1, u32&0xFF);
+    if (max_lvt > 6) {      /* in x2APIC mode, reading a missing register raises #GP */
+        u32 = read_localAPIC(LAPIC_LVT_CMCI);
+        printf("[APIC %u] LVT_CMCI   = 0x%08x mask=%u vector=%03u\n", CPU_ID, u32, (u32>>16)&1, u32&0xFF);
+    }
 
     u32 = read_localAPIC(LAPIC_LVT_LINT0);
     printf("[APIC %u] LVT_LINT0  = 0x%08x mask=%u vector=%03u\n", CPU_ID, u32, (u32>>16)&1, u32&0xFF);
@@ -45,10 +45,47 @@
 #ifndef APIC_H
 #define APIC_H
 
+#include "types.h"
+
 void apic_eoi(void);
-void send_ipi(uint8_t to, uint8_t vector);
+void send_ipi(unsigned to, uint8_t vector);
 void apic_init();
 void apic_init_ap(unsigned id);
 void print_apic(void);
 
+/*
+ * local APIC timer (one per CPU, the functions program the caller's timer)
+ * apic_timer_at() asks for an interrupt when the TSC reaches tsc: in TSC-deadline mode if
+ * deadline_mode is set and supported, else in one-shot mode. See time.h for the timer queue.
+ */
+#define TIMER_VECTOR    0x82
+int apic_timer_ok(void);
+int apic_timer_has_deadline(void);
+void apic_timer_periodic(unsigned long us);
+void apic_timer_oneshot(unsigned long us);
+void apic_timer_at(uint64_t tsc, unsigned deadline_mode);
+void apic_timer_stop(void);
+
+/*
+ * I/O APIC interrupt steering (the first I/O APIC only, cf. MAX_IOAPIC)
+ * irq is the I/O APIC input (GSI), irq_isa() translates legacy ISA IRQs (0: PIT, 1: keyboard),
+ * PCI devices (NIC) use their interrupt line. Input n is delivered as vector IRQ_VECTOR+n.
+ * ioapic_route() sends irq to one CPU of mask (without logical destination mode, several
+ * CPUs in mask spread the inputs: irq modulo the number of CPUs) and unmasks it.
+ *
+ * Isolation profile: irq_isolate() sends all device interrupts to CPU 0 and masks the
+ * LVT entries (timer, LINT0/1, perf, thermal, error, CMCI) of the CPUs in bench (except CPU 0).
+ * irq_unisolate() restores both and returns the number of interrupts the isolated CPUs got
+ * in between (irq_cnt in cpu_info_t counts all interrupts but the IPIs 0x80 and SMP_CALL_VECTOR).
+ * The timer queue (time.h) of an isolated CPU is deferred until irq_unisolate().
+ */
+#define IRQ_VECTOR      0x40
+#define IRQ_VECTORS     24
+unsigned irq_isa(unsigned isa_irq);
+unsigned ioapic_pins(void);
+int ioapic_route(unsigned irq, const cpumask_t *mask);
+void ioapic_mask(unsigned irq, unsigned masked);
+void irq_isolate(const cpumask_t *bench);
+unsigned long irq_unisolate(void);
+
 #endif // APIC_H
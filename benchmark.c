@@ -50,6 +50,10 @@
 #include "sync.h"
 #include "benchmark.h"
 #include "perfcount.h"
+#include "cpu.h"
+#include "task.h"
+#include "apic.h"
+#include "mm.h"
 
 extern volatile unsigned cpu_online;
 
@@ -274,11 +278,13 @@ void worker(volatile unsigned long *p_buffer, size_t range, size_t stride, acces
 
 void bench_hourglass()
 {
+    cpumask_t mask;
 
     if (CPU_ID == 0) printf("1 CPU hourglass (%u sec) ----------------------------------------------\n", bench_opt.timebase);
 
     barrier(&global_barrier);
-    if (collective_only(0x0001)) {
+    cpumask_fill(&mask, 1);
+    if (collective_only(&mask)) {
 
         udelay(1000000);
         printf("others halt         ");
@@ -290,37 +296,40 @@ void bench_hourglass()
 }
 
 
+#define BENCH_CONTENDER_MAX     (16*MB)     /* size of p_contender (see payload.c) */
+
 void bench_hourglass_worker(void *p_contender)
 {
     static barrier_t barr2 = BARRIER_INITIALIZER(2);        // barrier for two
     static flag_t flag = FLAG_INITIALIZER;
+    cpumask_t mask;
 
     if (cpu_online > 1) {
         if (CPU_ID == 0) printf("2 CPUs hourglass (%u sec) ---------------------------------------------\n", bench_opt.timebase);
         barrier(&global_barrier);
 
-        if (collective_only(0x0003)) {   /* IDs 0 and 1 */
-
-            unsigned u;
+        cpumask_fill(&mask, 2);
+        if (collective_only(&mask)) {   /* IDs 0 and 1 */
+
+            unsigned u, n = 0;
+            size_t l1 = topo_cache_size(1), l2 = topo_cache_size(2), l3 = topo_cache_size(3);
+            size_t sizes[12];
+
+            /* ranges from the cache sizes: half and full of each level, then beyond the last one */
+            if (l1) { sizes[n++] = l1/2; sizes[n++] = l1; }
+            if (l2) { sizes[n++] = l2/2; sizes[n++] = l2; }
+            if (l3) { sizes[n++] = l3/4; sizes[n++] = l3/2; sizes[n++] = l3*3/4; sizes[n++] = l3; }
+            if (n == 0) sizes[n++] = 16*1024;
+            sizes[n] = sizes[n-1] * 2;      /* larger than cache */
+            n++;
+            for (u = 0; u < n; u++) {
+                if (sizes[u] > BENCH_CONTENDER_MAX) sizes[u] = BENCH_CONTENDER_MAX;
+            }
 
             barrier(&barr2);
-            for (u=0; u<12; u++) {
-                size_t size = 1;
+            for (u=0; u<n; u++) {
+                size_t size = sizes[u];
                 if (CPU_ID == 1) {
-                    switch (u) {        /* Cache Ranges valid for xaxis, Core i7 */
-                        case  0: size=16*1024; break;        /* fits into L1 Cache */
-                        case  1: size=128*1024; break;       /* fits into L2 Cache */
-                        case  2: size=256*1024; break;       /* fits into L2 Cache */
-                        case  3: size=512*1024; break;       /* fits into L2 Cache */
-                        case  4: size=1*1024*1024; break;    /* fits into L3 Cache */
-                        case  5: size=2*1024*1024; break;    /* fits into L3 Cache */
-                        case  6: size=3*1024*1024; break;    /* fits into L3 Cache */
-                        case  7: size=4*1024*1024; break;    /* fits into L3 Cache */
-                        case  8: size=5*1024*1024; break;    /* fits into L3 Cache */
-                        case  9: size=6*1024*1024; break;    /* fits into L3 Cache */
-                        case 10: size=8*1024*1024; break;    /* fits into L3 Cache */
-                        case 11: size=16*1024*1024; break;   /* larger than Cache */
-                    }
                     printf("[1] Range %#uB: ", size);
                 }
                 barrier(&barr2);
@@ -343,12 +352,18 @@ void bench_hourglass_worker(void *p_contender)
 
 void bench_hourglass_hyperthread()
 {
+    cpumask_t mask;
+    unsigned sibling = topo_sibling(0);
 
-    if (cpu_online > 4) {     /* assuming, that the upper half of cores are hyperthreads */
-        if (CPU_ID == 0) printf("2 CPUs hourglass (hyper-threads) (%u sec) -----------------------------\n", bench_opt.timebase);
+    if (sibling < cpu_online) {
+        if (CPU_ID == 0) printf("2 CPUs hourglass (hyper-threads 0 and %u) (%u sec) ----------------------\n", 
+                sibling, bench_opt.timebase);
         barrier(&global_barrier);
 
-        if (collective_only(0x0001 | (1 << (cpu_online/2)))) {
+        cpumask_clear(&mask);
+        cpumask_set(&mask, 0);
+        cpumask_set(&mask, sibling);
+        if (collective_only(&mask)) {
             if (CPU_ID == 0) {
                 hourglass(bench_opt.timebase);
                 printf("\n");
@@ -470,6 +485,7 @@ void bench_worker_cut(void *p_buffer, void *p_contender, size_t worker_size)
 {
     unsigned myid = my_cpu_info()->cpu_id;
     static barrier_t barr2 = BARRIER_INITIALIZER(2);        // barrier for two
+    cpumask_t mask;
 
     /*
      * similar worker-benchmark, but different cuts through the parameter dimensions.
@@ -481,7 +497,8 @@ void bench_worker_cut(void *p_buffer, void *p_contender, size_t worker_size)
             perfcount_init(0, PERFCOUNT_L2); 
         }
 
-        if (collective_only(0x0003)) {
+        cpumask_fill(&mask, 2);
+        if (collective_only(&mask)) {
             unsigned r;
             static flag_t flag = FLAG_INITIALIZER;
 
@@ -565,6 +582,150 @@ void bench_rangestride(void *p_buffer)
 
 }
 
+/*
+ * TLB reach: pointer chase over one cache line per 4 kB of the working set in random page order
+ * (the cache footprint is 64 B per 4 kB, so that TLB misses dominate), for every page size.
+ * Reported are [cycles/access] and, on Intel, the page walks per 100 accesses and the walk cycles 
+ * per access. The last column repeats 4 kB pages with uncached page tables (mm_walk_cache()).
+ */
+#define BENCH_TLB_MAX       (32*MB)
+#define BENCH_TLB_ACCESSES  (1ul << 20)
+#if __x86_64__
+#   define BENCH_TLB_SIZES  3       /* 4 kB, 2 MB, 1 GB */
+#else
+#   define BENCH_TLB_SIZES  2       /* 4 kB, 4 MB */
+#endif
+
+static void * volatile bench_tlb_sink = 0;
+
+/* xorshift (no rand() in the kernel) */
+static uint32_t bench_rand(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* slot k: one cache line in the k-th 4 kB page (the line varies, to use all cache sets) */
+static inline void **tlb_slot(void *buf, unsigned long k)
+{
+    return (void**)((char*)buf + k * PAGE_SIZE + (k % (PAGE_SIZE / CACHE_LINE)) * CACHE_LINE);
+}
+
+/* one random cycle through the first n slots (Sattolo's shuffle on indices, then pointers) */
+static void tlb_chain(void *buf, unsigned long n)
+{
+    uint32_t seed = 0x2545F491;
+    unsigned long i, j, t;
+
+    for (i = 0; i < n; i++) *(unsigned long*)tlb_slot(buf, i) = i;
+    for (i = n - 1; i > 0; i--) {
+        j = bench_rand(&seed) % i;
+        t = *(unsigned long*)tlb_slot(buf, i);
+        *(unsigned long*)tlb_slot(buf, i) = *(unsigned long*)tlb_slot(buf, j);
+        *(unsigned long*)tlb_slot(buf, j) = t;
+    }
+    for (i = 0; i < n; i++) *tlb_slot(buf, i) = tlb_slot(buf, *(unsigned long*)tlb_slot(buf, i));
+}
+
+static void bench_tlb_run(void *buf, unsigned long n, unsigned pmu)
+{
+    void **p = tlb_slot(buf, 0);
+    unsigned long i;
+    uint64_t tsc, miss = 0, walk = 0;
+
+    tlb_chain(buf, n);
+    for (i = 0; i < n; i++) p = *p;     /* warm-up */
+
+    if (pmu) {
+        perfcount_reset(0);
+        perfcount_reset(1);
+        perfcount_start(0);
+        perfcount_start(1);
+    }
+    tsc = rdtsc();
+    for (i = 0; i < BENCH_TLB_ACCESSES; i++) p = *p;
+    tsc = rdtsc() - tsc;
+    if (pmu) {
+        perfcount_stop(0);
+        perfcount_stop(1);
+        miss = perfcount_read(0);
+        walk = perfcount_read(1);
+    }
+    bench_tlb_sink = p;
+
+    printf(" | %4u", (unsigned long)(tsc / BENCH_TLB_ACCESSES));
+    if (pmu) printf(" %3u %4u", (unsigned long)(miss * 100 / BENCH_TLB_ACCESSES), (unsigned long)(walk / BENCH_TLB_ACCESSES));
+}
+
+void bench_tlb()
+{
+    static const unsigned flags[3] = { 0, MM_HUGE, MM_HUGE_1G };
+    static const size_t sets[] = {64*KB, 256*KB, 1*MB, 4*MB, 8*MB, 16*MB, 32*MB};
+
+    if (CPU_ID == 0) {
+        unsigned pmu = (hw_info.cpu_vendor == vend_intel);
+        void *buf[BENCH_TLB_SIZES];
+        size_t psize[BENCH_TLB_SIZES], set;
+        unsigned k, u;
+
+        printf("TLB reach: random page access [cycles%s] (other CPUs in halt-state) --\n",
+                pmu ? ", walks/100, walk cycles" : "");
+
+        /* 
+         * the 1 GB column only with CPU support and a free 1 GB block (the others are halted);
+         * elsewhere, a smaller page size can be a duplicate, too
+         */
+        for (k = 0; k < BENCH_TLB_SIZES; k++) {
+            buf[k] = NULL;
+            psize[k] = 0;
+            if (flags[k] & MM_HUGE_1G) {
+                frame_t frame;
+                if (!mm_huge_supported(flags[k])) continue;
+                frame = frame_alloc(2*INDEX_BITS);
+                if (frame == 0) continue;
+                frame_free(frame, 2*INDEX_BITS);
+            }
+            buf[k] = heap_alloc(BENCH_TLB_MAX / PAGE_SIZE, flags[k]);
+            psize[k] = mm_page_size(buf[k]);
+        }
+        if (pmu) {
+            perfcount_init(0, PERFCOUNT_DTLB_MISS);
+            perfcount_init(1, PERFCOUNT_DTLB_WALK);
+        }
+
+        printf("working set");
+        for (k = 0; k < BENCH_TLB_SIZES; k++) {
+            if (buf[k] != NULL && (k == 0 || psize[k] != psize[k-1])) printf(" | %#uB pages", psize[k]);
+        }
+        printf(" | %#uB, UC walk\n", psize[0]);
+
+        foreach (set, sets) {
+            printf("%#uB    ", set);
+            for (k = 0; k < BENCH_TLB_SIZES; k++) {
+                if (buf[k] != NULL && (k == 0 || psize[k] != psize[k-1])) bench_tlb_run(buf[k], set / PAGE_SIZE, pmu);
+            }
+            mm_walk_cache(buf[0], set, MM_CACHE_DISABLE);
+            bench_tlb_run(buf[0], set / PAGE_SIZE, pmu);
+            mm_walk_cache(buf[0], set, 0);
+            printf("\n");
+        }
+
+        for (u = 1; u<cpu_online; u++) {
+            smp_wakeup(u);
+        }
+        /* the others answer the TLB shootdown from the barrier */
+        for (k = 0; k < BENCH_TLB_SIZES; k++) {
+            if (buf[k] != NULL) heap_free(buf[k], BENCH_TLB_MAX / PAGE_SIZE);
+        }
+    } else {
+        smp_halt();
+    }
+    barrier(&global_barrier);
+}
+
 void bench_mem(void *p_buffer, void *p_contender)
 {
     static barrier_t barr2 = BARRIER_INITIALIZER(2);        // barrier for two
@@ -654,3 +815,1117 @@ void bench_mem(void *p_buffer, void *p_contender)
 
 }
 
+
+/*
+ * Lock benchmarks: mutex_t (test-and-set), ticketlock_t and mcslock_t (MCS queue lock)
+ */
+typedef enum {LT_MUTEX, LT_TICKET, LT_MCS, LT_CNT} locktype_t;
+static char *locktype_name[] = {"mutex", "ticket", "mcs"};
+static mutex_t bench_mutex = MUTEX_INITIALIZER;
+static ticketlock_t bench_ticket = TICKETLOCK_INITIALIZER;
+static mcslock_t bench_mcs = MCSLOCK_INITIALIZER;
+static volatile unsigned long bench_lock_counter;
+
+static inline void bench_lock_pair(locktype_t type)
+{
+    switch (type) {
+        case LT_MUTEX :
+            mutex_lock(&bench_mutex);
+            bench_lock_counter++;
+            mutex_unlock(&bench_mutex);
+            break;
+        case LT_TICKET :
+            ticketlock_lock(&bench_ticket);
+            bench_lock_counter++;
+            ticketlock_unlock(&bench_ticket);
+            break;
+        default :
+            mcslock_lock(&bench_mcs);
+            bench_lock_counter++;
+            mcslock_unlock(&bench_mcs);
+            break;
+    }
+}
+
+/*
+ * n = 1 .. cpu_online CPUs acquire the same lock BENCH_LOCK_ITER times each,
+ * reported are the TSC cycles per lock/unlock pair (average over the contending CPUs)
+ * and the maximum of any CPU.
+ */
+#define BENCH_LOCK_ITER     100000
+void bench_lock()
+{
+    static uint64_t cycles[MAX_CPU];
+    unsigned myid = CPU_ID;
+    unsigned n, u, i;
+    locktype_t type;
+    uint64_t tsc, sum, max;
+
+    if (myid == 0) printf("Lock benchmark (%u lock/unlock per CPU) [cycles avg/max] ---------------\n", BENCH_LOCK_ITER);
+
+    for (n = 1; n <= cpu_online; n++) {
+        if (myid == 0) printf("%2u CPU(s): ", n);
+        for (type = 0; type < LT_CNT; type++) {
+            if (myid == 0) bench_lock_counter = 0;
+            barrier(&global_barrier);
+            if (myid < n) {
+                tsc = rdtsc();
+                for (i = 0; i < BENCH_LOCK_ITER; i++) {
+                    bench_lock_pair(type);
+                }
+                cycles[myid] = rdtsc() - tsc;
+            }
+            barrier(&global_barrier);
+            if (myid == 0) {
+                sum = 0; max = 0;
+                for (u = 0; u < n; u++) {
+                    sum += cycles[u];
+                    if (cycles[u] > max) max = cycles[u];
+                }
+                printf(" %s %u/%u%s", locktype_name[type], 
+                        (unsigned long)(sum / n / BENCH_LOCK_ITER), 
+                        (unsigned long)(max / BENCH_LOCK_ITER),
+                        (bench_lock_counter == n*BENCH_LOCK_ITER) ? "" : " (ERROR: lost updates)");
+            }
+        }
+        if (myid == 0) printf("\n");
+    }
+    barrier(&global_barrier);
+}
+
+/*
+ * Lock fairness: all CPUs acquire the same lock for bench_opt.timebase seconds,
+ * reported is the number of acquisitions per CPU and the ratio min/max (100%: fair).
+ */
+void bench_lock_fairness()
+{
+    static unsigned long acquired[MAX_CPU];
+    unsigned myid = CPU_ID;
+    unsigned u;
+    unsigned long cnt, min, max;
+    locktype_t type;
+    uint64_t tsc_end;
+
+    if (myid == 0) printf("Lock fairness (%u sec, %u CPUs) [acquisitions per CPU] ---------------\n", 
+            bench_opt.timebase, cpu_online);
+
+    for (type = 0; type < LT_CNT; type++) {
+        barrier(&global_barrier);
+        cnt = 0;
+        tsc_end = rdtsc() + bench_opt.timebase * 1000000ull * hw_info.tsc_per_usec;
+        while (rdtsc() < tsc_end) {
+            bench_lock_pair(type);
+            cnt++;
+        }
+        acquired[myid] = cnt;
+        barrier(&global_barrier);
+        if (myid == 0) {
+            min = ~0ul; max = 0;
+            printf("%6s:", locktype_name[type]);
+            for (u = 0; u < cpu_online; u++) {
+                printf(" [%u] %u", u, acquired[u]);
+                if (acquired[u] < min) min = acquired[u];
+                if (acquired[u] > max) max = acquired[u];
+            }
+            printf("  min/max %u%%\n", (max > 0) ? (100 * min / max) : 0);
+        }
+    }
+    barrier(&global_barrier);
+}
+
+/*
+ * Barrier benchmark: round-trip latency of barrier_central(), barrier_tree() and
+ * barrier_topo() for 2 .. cpu_online participants (CPUs 0 .. n-1), in TSC cycles 
+ * per barrier (maximum over the participants), and the release skew: 
+ * the average difference between the first and the last CPU leaving a barrier
+ * (assumes synchronized TSCs). barrier_topo() only differs from barrier_tree()
+ * if all online CPUs participate.
+ */
+#define BENCH_BARRIER_ITER  10000
+#define BENCH_SKEW_ITER     1000
+static char *barrier_name[] = {"central", "tree", "topo"};
+
+static void bench_barrier_type(barrier_t *b, unsigned type)
+{
+    switch (type) {
+        case 0 : barrier_central(b); break;
+        case 1 : barrier_tree(b); break;
+        default : barrier_topo(b);
+    }
+}
+
+void bench_barrier()
+{
+    static barrier_t barr = BARRIER_INITIALIZER(2);
+    static uint64_t cycles[3][MAX_CPU];
+    static struct {
+        volatile uint64_t tsc;
+    } __attribute__((aligned(CACHE_LINE))) exit_tsc[MAX_CPU];
+    static uint64_t skew[3];
+    unsigned myid = CPU_ID;
+    unsigned n, i, u, type;
+    uint64_t tsc, max, min;
+
+    if (cpu_online < 2) return;
+
+    if (myid == 0) printf("Barrier benchmark (%u episodes) [cycles per barrier / release skew] -----\n", BENCH_BARRIER_ITER);
+
+    for (n = 2; n <= cpu_online; n++) {
+        for (type = 0; type < 3; type++) {
+            if (myid == 0) {
+                barrier_init(&barr, n);
+                skew[type] = 0;
+            }
+            barrier(&global_barrier);
+            if (myid < n) {
+                /* warm-up */
+                for (i = 0; i < 100; i++) {
+                    bench_barrier_type(&barr, type);
+                }
+                tsc = rdtsc();
+                for (i = 0; i < BENCH_BARRIER_ITER; i++) {
+                    bench_barrier_type(&barr, type);
+                }
+                cycles[type][myid] = rdtsc() - tsc;
+
+                /* release skew: CPU 0 evaluates the exit times before it enters the next episode */
+                for (i = 0; i < BENCH_SKEW_ITER; i++) {
+                    bench_barrier_type(&barr, type);
+                    exit_tsc[myid].tsc = rdtsc();
+                    bench_barrier_type(&barr, type);
+                    if (myid == 0) {
+                        max = 0;
+                        min = (uint64_t)-1;
+                        for (u = 0; u < n; u++) {
+                            if (exit_tsc[u].tsc > max) max = exit_tsc[u].tsc;
+                            if (exit_tsc[u].tsc < min) min = exit_tsc[u].tsc;
+                        }
+                        skew[type] += max - min;
+                    }
+                }
+            }
+            barrier(&global_barrier);
+        }
+        if (myid == 0) {
+            printf("%2u CPUs:", n);
+            for (type = 0; type < 3; type++) {
+                max = 0;
+                for (u = 0; u < n; u++) {
+                    if (cycles[type][u] > max) max = cycles[type][u];
+                }
+                printf("  %s %u/%u", barrier_name[type],
+                        (unsigned long)(max / BENCH_BARRIER_ITER), (unsigned long)(skew[type] / BENCH_SKEW_ITER));
+            }
+            printf("\n");
+        }
+    }
+    barrier(&global_barrier);
+}
+
+/*
+ * Wait policy benchmark: for every wait policy, CPU 0 wakes a waiting CPU 
+ * BENCH_WAIT_ITER times (after BENCH_WAIT_DELAY cycles each) and the waiter
+ * measures the wake-up latency [cycles]. Meanwhile, the SMT sibling of the waiter
+ * (if there is one) runs a fixed integer loop; its throughput [loops per 1M cycles]
+ * shows how much the waiting policy disturbs the sibling.
+ */
+#define BENCH_WAIT_ITER     1000
+#define BENCH_WAIT_DELAY    20000
+
+static unsigned bench_wait_work(unsigned x)
+{
+    unsigned u;
+    for (u = 0; u < 64; u++) {
+        x = x * 1103515245 + 12345;
+    }
+    return x;
+}
+
+void bench_wait()
+{
+    static volatile unsigned word, ack, stop;
+    static volatile uint64_t wake_tsc;
+    static uint64_t latency, latency_max, loops, loop_cycles;
+    static unsigned waiter, sibling;
+    unsigned myid = CPU_ID;
+    unsigned i, u, x = myid;
+    wait_policy_t policy;
+    uint64_t tsc, lat;
+
+    if (cpu_online < 2) return;
+
+    if (myid == 0) {
+        /* find a waiter (not CPU 0) with an SMT sibling (not CPU 0) */
+        waiter = 1;
+        sibling = MAX_CPU;
+        for (u = 1; u < cpu_online && sibling == MAX_CPU; u++) {
+            for (i = 1; i < cpu_online; i++) {
+                if (i != u && topo_same_core(i, u)) {
+                    waiter = u;
+                    sibling = i;
+                    break;
+                }
+            }
+        }
+        printf("Wait policy benchmark (%u wake-ups) waker: CPU 0, waiter: CPU %u, sibling: ", BENCH_WAIT_ITER, waiter);
+        if (sibling < MAX_CPU) printf("CPU %u\n", sibling); else printf("none\n");
+    }
+
+    for (policy = 0; policy < WAIT_CNT; policy++) {
+        if (myid == 0) {
+            word = 0;
+            ack = 0;
+            stop = 0;
+            latency = 0;
+            latency_max = 0;
+            loops = 0;
+            loop_cycles = 1;
+        }
+        barrier(&global_barrier);
+
+        if (myid == 0) {
+            for (i = 1; i <= BENCH_WAIT_ITER; i++) {
+                tsc = rdtsc();
+                while (rdtsc() - tsc < BENCH_WAIT_DELAY) pause();
+                wake_tsc = rdtsc();
+                word = i;
+                wait_wake(&word);
+                while (ack != i) pause();
+            }
+            stop = 1;
+        } else if (myid == waiter) {
+            for (i = 1; i <= BENCH_WAIT_ITER; i++) {
+                while (word != i) wait_change(&word, i - 1, policy);
+                lat = rdtsc() - wake_tsc;
+                latency += lat;
+                if (lat > latency_max) latency_max = lat;
+                ack = i;
+            }
+        } else if (myid == sibling) {
+            tsc = rdtsc();
+            while (!stop) {
+                x = bench_wait_work(x);
+                loops++;
+            }
+            loop_cycles = rdtsc() - tsc;
+        }
+        barrier(&global_barrier);
+
+        if (myid == 0) {
+            printf("%-8s latency avg %u max %u", wait_policy_name[policy], 
+                    (unsigned long)(latency / BENCH_WAIT_ITER), (unsigned long)latency_max);
+            if (sibling < MAX_CPU) {
+                printf("  sibling: %u loops/Mcycle", (unsigned long)(loops * 1000000 / loop_cycles));
+            }
+            printf("\n");
+        }
+    }
+    barrier(&global_barrier);
+    if (x == 1) printf(" ");    /* keep the work loop */
+}
+
+/*
+ * Synchronization benchmark: cycles per operation (min/avg/max over all operations
+ * of all participating CPUs 0 .. n-1) for n = 1 .. cpu_online of
+ *  - mutex_lock()/mutex_unlock() pairs on one shared mutex
+ *  - barrier() round trip
+ *  - flag_signal() -> flag_wait() hand-off from CPU 0 to CPU n-1 (n >= 2)
+ *  - collective_only()/collective_end() (the others halt and are woken up)
+ */
+#define BENCH_SYNC_ITER     10000
+#define BENCH_SYNC_COLL     20
+
+typedef struct {
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    unsigned long cnt;
+} __attribute__((aligned(CACHE_LINE))) sync_stat_t;
+static sync_stat_t sync_stat[MAX_CPU];
+
+static void sync_stat_add(sync_stat_t *s, uint64_t cycles)
+{
+    if (cycles < s->min) s->min = cycles;
+    if (cycles > s->max) s->max = cycles;
+    s->sum += cycles;
+    s->cnt++;
+}
+
+/* reset own statistics, then synchronize */
+static void sync_stat_start(void)
+{
+    sync_stat_t *s = &sync_stat[CPU_ID];
+    s->min = (uint64_t)-1;
+    s->max = 0;
+    s->sum = 0;
+    s->cnt = 0;
+    barrier(&global_barrier);
+}
+
+/* synchronize, then CPU 0 prints the statistics of all CPUs */
+static void sync_stat_report(const char *name, unsigned n)
+{
+    uint64_t min = (uint64_t)-1, max = 0, sum = 0;
+    unsigned long cnt = 0;
+    unsigned u;
+
+    barrier(&global_barrier);
+    if (CPU_ID != 0) return;
+    for (u = 0; u < cpu_online; u++) {
+        if (sync_stat[u].cnt == 0) continue;
+        if (sync_stat[u].min < min) min = sync_stat[u].min;
+        if (sync_stat[u].max > max) max = sync_stat[u].max;
+        sum += sync_stat[u].sum;
+        cnt += sync_stat[u].cnt;
+    }
+    if (cnt == 0) return;
+    printf("%-10s %2u CPUs: min %6u  avg %6u  max %8u\n", name, n, 
+            (unsigned long)min, (unsigned long)(sum / cnt), (unsigned long)max);
+}
+
+void bench_sync()
+{
+    static mutex_t mutex = MUTEX_INITIALIZER;
+    static barrier_t barr = BARRIER_INITIALIZER(1);
+    static flag_t ping = FLAG_INITIALIZER;
+    static flag_t pong = FLAG_INITIALIZER;
+    static volatile uint64_t signal_tsc;
+    sync_stat_t *s = &sync_stat[CPU_ID];
+    unsigned myid = CPU_ID;
+    unsigned n, i;
+    uint64_t tsc;
+    cpumask_t mask;
+
+    if (myid == 0) printf("Synchronization benchmark [cycles per operation] --------------------------\n");
+
+    /* mutex_lock()/mutex_unlock() */
+    for (n = 1; n <= cpu_online; n++) {
+        sync_stat_start();
+        if (myid < n) {
+            for (i = 0; i < BENCH_SYNC_ITER; i++) {
+                tsc = rdtsc();
+                mutex_lock(&mutex);
+                mutex_unlock(&mutex);
+                sync_stat_add(s, rdtsc() - tsc);
+            }
+        }
+        sync_stat_report("mutex", n);
+    }
+
+    /* barrier() */
+    for (n = 1; n <= cpu_online; n++) {
+        if (myid == 0) barrier_init(&barr, n);
+        sync_stat_start();
+        if (myid < n) {
+            for (i = 0; i < BENCH_SYNC_ITER; i++) {
+                tsc = rdtsc();
+                barrier(&barr);
+                sync_stat_add(s, rdtsc() - tsc);
+            }
+        }
+        sync_stat_report("barrier", n);
+    }
+
+    /* flag_signal() -> flag_wait() (ping from CPU 0, measured by the receiver; pong back) */
+    for (n = 2; n <= cpu_online; n++) {
+        if (myid == 0) {
+            flag_init(&ping);
+            flag_init(&pong);
+        }
+        sync_stat_start();
+        for (i = 0; i < BENCH_SYNC_ITER; i++) {
+            if (myid == 0) {
+                signal_tsc = rdtsc();
+                flag_signal(&ping);
+                flag_wait(&pong);
+            } else if (myid == n-1) {
+                flag_wait(&ping);
+                sync_stat_add(s, rdtsc() - signal_tsc);
+                flag_signal(&pong);
+            } else {
+                break;
+            }
+        }
+        sync_stat_report("flag", n);
+    }
+
+    /* collective_only()/collective_end() */
+    for (n = 1; n <= cpu_online; n++) {
+        sync_stat_start();
+        for (i = 0; i < BENCH_SYNC_COLL; i++) {
+            tsc = rdtsc();
+            cpumask_fill(&mask, n);
+            if (collective_only(&mask)) {
+                collective_end();
+                sync_stat_add(s, rdtsc() - tsc);
+            }
+            barrier(&global_barrier);
+        }
+        sync_stat_report("collective", n);
+    }
+}
+
+/*
+ * SPSC streaming benchmark: for every pair of CPUs, the producer streams 
+ * BENCH_SPSC_MSGS messages of BENCH_SPSC_SIZE bytes through an spsc_t ring
+ * to the consumer, which reports messages/s and bytes/s.
+ */
+#define BENCH_SPSC_MSGS     200000
+#define BENCH_SPSC_SIZE     64
+#define BENCH_SPSC_SLOTS    256
+#define BENCH_SPSC_BATCH    16
+
+typedef struct {
+    unsigned long seq;
+    char payload[BENCH_SPSC_SIZE - sizeof(unsigned long)];
+} bench_msg_t;
+
+void bench_spsc()
+{
+    static spsc_t ring;
+    static char buf[BENCH_SPSC_SLOTS * BENCH_SPSC_SIZE] __attribute__((aligned(CACHE_LINE)));
+    static volatile uint64_t cycles;
+    static volatile unsigned long errors;
+    unsigned myid = CPU_ID;
+    unsigned prod, cons;
+    unsigned long i;
+    bench_msg_t msg;
+    uint64_t tsc, rate;
+
+    if (cpu_online < 2) return;
+
+    if (myid == 0) printf("SPSC streaming benchmark (%u messages of %u bytes, batch %u) ------------\n", 
+            BENCH_SPSC_MSGS, BENCH_SPSC_SIZE, BENCH_SPSC_BATCH);
+    memset(&msg, 0, sizeof(msg));
+
+    for (prod = 0; prod < cpu_online; prod++) {
+        for (cons = 0; cons < cpu_online; cons++) {
+            if (prod == cons) continue;
+            if (myid == 0) {
+                spsc_init(&ring, buf, BENCH_SPSC_SLOTS, BENCH_SPSC_SIZE, BENCH_SPSC_BATCH);
+                errors = 0;
+            }
+            barrier(&global_barrier);
+            if (myid == prod) {
+                for (i = 0; i < BENCH_SPSC_MSGS; i++) {
+                    msg.seq = i;
+                    spsc_send(&ring, &msg);
+                }
+                spsc_flush_send(&ring);
+            } else if (myid == cons) {
+                tsc = rdtsc();
+                for (i = 0; i < BENCH_SPSC_MSGS; i++) {
+                    spsc_recv(&ring, &msg);
+                    if (msg.seq != i) errors++;
+                }
+                spsc_flush_recv(&ring);
+                cycles = rdtsc() - tsc;
+            }
+            barrier(&global_barrier);
+            if (myid == 0) {
+                rate = (BENCH_SPSC_MSGS * 1000000ull * hw_info.tsc_per_usec) / cycles;
+                printf("%2u -> %2u: %u kmsg/s  %u MB/s", prod, cons, (unsigned long)(rate / 1000), 
+                        (unsigned long)((rate * BENCH_SPSC_SIZE) >> 20));
+                if (errors) printf("  (%u errors)", errors);
+                printf("\n");
+            }
+        }
+    }
+    barrier(&global_barrier);
+}
+
+/*
+ * MPMC queue scaling benchmark: k producers (CPUs 0 .. k-1) and k consumers
+ * (CPUs k .. 2k-1) move BENCH_MPMC_ITEMS items each through one mpmc_t queue;
+ * reported are the enqueue+dequeue operations per second (and a checksum test).
+ * Additionally, n = 1 .. cpu_online CPUs each alternate enqueue and dequeue.
+ */
+#define BENCH_MPMC_ITEMS    100000      /* even (checksum) */
+#define BENCH_MPMC_CELLS    1024
+
+void bench_mpmc()
+{
+    static mpmc_t queue;
+    static mpmc_cell_t cells[BENCH_MPMC_CELLS];
+    static uint64_t cycles[MAX_CPU];
+    static volatile unsigned long sum_in, sum_out;
+    unsigned myid = CPU_ID;
+    unsigned k, n, u, mode;
+    unsigned long i, s;
+    void *data;
+    uint64_t tsc, max;
+
+    if (myid == 0) printf("MPMC queue benchmark (%u items per CPU, %u cells) [Mops/s] --------------\n", 
+            BENCH_MPMC_ITEMS, BENCH_MPMC_CELLS);
+
+    for (mode = 0; mode < 2; mode++) {
+        for (k = 1; k <= (mode ? cpu_online : cpu_online / 2); k++) {
+            n = mode ? k : 2 * k;       /* participating CPUs */
+            if (myid == 0) {
+                mpmc_init(&queue, cells, BENCH_MPMC_CELLS);
+                sum_in = 0;
+                sum_out = 0;
+            }
+            barrier(&global_barrier);
+            cycles[myid] = 0;
+            s = 0;
+            if (myid < n) {
+                tsc = rdtsc();
+                if (mode) {
+                    /* everybody: enqueue one, dequeue one */
+                    for (i = 1; i <= BENCH_MPMC_ITEMS; i++) {
+                        while (!mpmc_tryenqueue(&queue, (void*)i)) pause();
+                        while (!mpmc_trydequeue(&queue, &data)) pause();
+                        s += (unsigned long)data;
+                    }
+                    __sync_add_and_fetch(&sum_in, (unsigned long)(BENCH_MPMC_ITEMS / 2) * (BENCH_MPMC_ITEMS + 1));
+                } else if (myid < k) {
+                    /* producer */
+                    for (i = 1; i <= BENCH_MPMC_ITEMS; i++) {
+                        while (!mpmc_tryenqueue(&queue, (void*)i)) pause();
+                    }
+                    __sync_add_and_fetch(&sum_in, (unsigned long)(BENCH_MPMC_ITEMS / 2) * (BENCH_MPMC_ITEMS + 1));
+                } else {
+                    /* consumer */
+                    for (i = 1; i <= BENCH_MPMC_ITEMS; i++) {
+                        while (!mpmc_trydequeue(&queue, &data)) pause();
+                        s += (unsigned long)data;
+                    }
+                }
+                cycles[myid] = rdtsc() - tsc;
+                __sync_add_and_fetch(&sum_out, s);
+            }
+            barrier(&global_barrier);
+            if (myid == 0) {
+                max = 1;
+                for (u = 0; u < n; u++) {
+                    if (cycles[u] > max) max = cycles[u];
+                }
+                /* every item is enqueued and dequeued once: 2 ops per item */
+                if (mode) {
+                    printf("%2u CPUs enq+deq:       ", n);
+                } else {
+                    printf("%2u producers %2u consumers:", k, k);
+                }
+                printf(" %u Mops/s%s\n", 
+                        (unsigned long)((2ull * (mode ? n : k) * BENCH_MPMC_ITEMS * hw_info.tsc_per_usec) / max),
+                        (sum_in == sum_out) ? "" : "  (checksum ERROR)");
+            }
+        }
+    }
+    barrier(&global_barrier);
+}
+
+/*
+ * Task runtime benchmark: speed-up of the work-stealing runtime (task.c) 
+ * for 1 .. cpu_online workers with
+ *  - recursive fib(BENCH_TASK_FIB) (spawn/sync, sequential below BENCH_TASK_CUTOFF)
+ *  - parallel_for: initialize and sum up BENCH_TASK_ELEMS words of p_buffer
+ */
+#define BENCH_TASK_FIB      27
+#define BENCH_TASK_CUTOFF   12
+#define BENCH_TASK_ELEMS    (1024*1024)
+#define BENCH_TASK_GRAIN    4096
+
+typedef struct {
+    unsigned n;
+    unsigned long result;
+} bench_fib_t;
+
+static unsigned long fib_seq(unsigned n)
+{
+    return (n < 2) ? n : fib_seq(n-1) + fib_seq(n-2);
+}
+
+static void bench_fib_task(void *p)
+{
+    bench_fib_t *f = (bench_fib_t*)p;
+    bench_fib_t f1, f2;
+    task_group_t group = TASK_GROUP_INITIALIZER;
+
+    if (f->n < BENCH_TASK_CUTOFF) {
+        f->result = fib_seq(f->n);
+        return;
+    }
+    f1.n = f->n - 1;
+    f2.n = f->n - 2;
+    task_spawn(&group, bench_fib_task, &f1);
+    bench_fib_task(&f2);
+    task_sync(&group);
+    f->result = f1.result + f2.result;
+}
+
+static struct {
+    unsigned long sum;
+} __attribute__((aligned(CACHE_LINE))) bench_task_sum[MAX_CPU];
+
+static void bench_init_body(unsigned i, void *p_buffer)
+{
+    ((unsigned*)p_buffer)[i] = i;
+}
+
+static void bench_sum_body(unsigned i, void *p_buffer)
+{
+    bench_task_sum[CPU_ID].sum += ((unsigned*)p_buffer)[i];
+}
+
+static uint64_t bench_task_cycles;
+static unsigned long bench_task_result;
+
+static void bench_fib_root(void *p)
+{
+    bench_fib_t *f = (bench_fib_t*)p;
+    uint64_t tsc = rdtsc();
+    bench_fib_task(f);
+    bench_task_cycles = rdtsc() - tsc;
+    bench_task_result = f->result;
+}
+
+static void bench_for_root(void *p_buffer)
+{
+    unsigned u;
+    uint64_t tsc = rdtsc();
+    for (u = 0; u < cpu_online; u++) bench_task_sum[u].sum = 0;
+    task_parallel_for(0, BENCH_TASK_ELEMS, BENCH_TASK_GRAIN, bench_init_body, p_buffer);
+    task_parallel_for(0, BENCH_TASK_ELEMS, BENCH_TASK_GRAIN, bench_sum_body, p_buffer);
+    bench_task_cycles = rdtsc() - tsc;
+    bench_task_result = 0;
+    for (u = 0; u < cpu_online; u++) bench_task_result += bench_task_sum[u].sum;
+}
+
+void bench_task(void *p_buffer)
+{
+    static uint64_t base[2];
+    static bench_fib_t fib = { .n = BENCH_TASK_FIB };
+    unsigned n, type;
+    uint64_t speedup;
+
+    if (CPU_ID == 0) printf("Task runtime benchmark: fib(%u), parallel_for init+sum of %u words -------\n", 
+            BENCH_TASK_FIB, BENCH_TASK_ELEMS);
+
+    for (type = 0; type < 2; type++) {
+        for (n = 1; n <= cpu_online; n++) {
+            if (type == 0) {
+                task_run(n, bench_fib_root, &fib);
+            } else {
+                task_run(n, bench_for_root, p_buffer);
+            }
+            if (CPU_ID == 0) {
+                if (n == 1) base[type] = bench_task_cycles;
+                speedup = (base[type] * 100) / (bench_task_cycles ? bench_task_cycles : 1);
+                printf("%s %2u CPUs: %u cycles, speed-up %u.%02u (result %u)\n", 
+                        type ? "for" : "fib", n, (unsigned long)bench_task_cycles, 
+                        (unsigned long)(speedup / 100), (unsigned long)(speedup % 100), bench_task_result);
+            }
+        }
+    }
+    barrier(&global_barrier);
+}
+
+static unsigned long bench_row[MAX_CPU];    /* one row of a CPU x CPU matrix (filled by the measuring CPUs) */
+
+/* matrix output: sender/first CPU in the rows, receiver/second CPU in the columns */
+static void bench_matrix_head(const char *title)
+{
+    unsigned r;
+    printf("%s\ns\\r ", title);
+    for (r = 0; r < cpu_online; r++) printf(" %6u", r);
+    printf("\n");
+}
+
+static void bench_matrix_row(unsigned s)
+{
+    unsigned r;
+    printf("%3u ", s);
+    for (r = 0; r < cpu_online; r++) {
+        if (r == s) printf("      -"); 
+        else printf(" %6u", bench_row[r]);
+    }
+    printf("\n");
+}
+
+/*
+ * IPI benchmark (vector 0x80, the handler in isr.c stores the TSC at entry):
+ *  - one-way latency send_ipi() -> handler entry (TSCs of all CPUs must be synchronous)
+ *  - round-trip latency (ping-pong: the receiver answers with an IPI)
+ * both as matrix [avg. cycles] with the sender in the rows and the receiver in the columns,
+ *  - throughput of IPIs into CPU 0 from 1 .. n-1 senders (concurrent IPIs of the same vector
+ *    are merged in the IRR, so received counts the handler calls)
+ */
+#define BENCH_IPI_ITER      1000
+#define BENCH_IPI_FLOOD_MS  100
+
+/* wait for the next IPI (my count changes from *last) */
+static void bench_ipi_wait(unsigned long *last)
+{
+    volatile cpu_info_t *info = my_cpu_info();
+    while (info->ipi_cnt == *last) pause();
+    *last = info->ipi_cnt;
+}
+
+static void bench_ipi_matrix(unsigned roundtrip)
+{
+    static volatile uint64_t send_tsc;
+    static volatile unsigned ack, ready;
+    unsigned myid = CPU_ID;
+    unsigned s, r, i, a;
+    unsigned long last;
+    uint64_t sum, tsc;
+
+    if (myid == 0) bench_matrix_head(roundtrip ? "round-trip [cycles]" : "one-way [cycles]");
+    for (s = 0; s < cpu_online; s++) {
+        for (r = 0; r < cpu_online; r++) {
+            if (myid == 0) {
+                bench_row[r] = 0;
+                ack = 0;
+                ready = 0;
+            }
+            barrier(&global_barrier);
+            if (r == s) continue;
+            sum = 0;
+            last = my_cpu_info()->ipi_cnt;
+            if (myid == r) {
+                ready = 1;
+            } else if (myid == s) {
+                while (!ready) pause();     /* the receiver has read its count */
+            }
+            if (myid == s) {
+                for (i = 0; i < BENCH_IPI_ITER; i++) {
+                    if (roundtrip) {
+                        tsc = rdtsc();
+                        send_ipi(r, 0x80);
+                        bench_ipi_wait(&last);
+                        sum += rdtsc() - tsc;
+                    } else {
+                        a = ack;
+                        send_tsc = rdtsc();
+                        send_ipi(r, 0x80);
+                        while (ack == a) pause();   /* receiver has taken its time */
+                    }
+                }
+                if (roundtrip) bench_row[r] = sum / BENCH_IPI_ITER;
+            } else if (myid == r) {
+                for (i = 0; i < BENCH_IPI_ITER; i++) {
+                    bench_ipi_wait(&last);
+                    if (roundtrip) {
+                        send_ipi(s, 0x80);
+                    } else {
+                        sum += my_cpu_info()->ipi_tsc - send_tsc;
+                        ack++;
+                    }
+                }
+                if (!roundtrip) bench_row[r] = sum / BENCH_IPI_ITER;
+            }
+        }
+        barrier(&global_barrier);
+        if (myid == 0) bench_matrix_row(s);
+    }
+}
+
+void bench_ipi()
+{
+    static volatile unsigned long sent;
+    unsigned myid = CPU_ID;
+    unsigned n, if_backup;
+    unsigned long cnt = 0, my_sent;
+    uint64_t tsc = 0, tsc_end, us;
+
+    if (cpu_online < 2) {
+        if (myid == 0) printf("bench_ipi: needs more than one CPU\n");
+        return;
+    }
+    if (myid == 0) printf("IPI benchmark (vector 0x80, %u iterations per pair) ----------------------\n", BENCH_IPI_ITER);
+
+    if_backup = sti();
+    bench_ipi_matrix(0);
+    bench_ipi_matrix(1);
+
+    /* throughput: n-1 senders flood CPU 0 for BENCH_IPI_FLOOD_MS */
+    for (n = 2; n <= cpu_online; n++) {
+        if (myid == 0) sent = 0;
+        barrier(&global_barrier);
+        if (myid == 0) {
+            cnt = my_cpu_info()->ipi_cnt;
+            tsc = rdtsc();
+        } else if (myid < n) {
+            my_sent = 0;
+            tsc_end = rdtsc() + BENCH_IPI_FLOOD_MS * 1000ull * hw_info.tsc_per_usec;
+            while (rdtsc() < tsc_end) {
+                send_ipi(0, 0x80);
+                my_sent++;
+            }
+            __sync_add_and_fetch(&sent, my_sent);
+        }
+        barrier(&global_barrier);
+        if (myid == 0) {
+            cnt = my_cpu_info()->ipi_cnt - cnt;
+            us = (rdtsc() - tsc) / hw_info.tsc_per_usec;
+            printf("throughput %2u senders -> CPU 0: sent %8u  received %8u  (%u per ms)\n", 
+                    n-1, sent, cnt, (unsigned long)(cnt * 1000 / (us ? us : 1)));
+        }
+    }
+
+    barrier(&global_barrier);
+    if (!if_backup) cli();
+}
+
+/*
+ * TLB shootdown latency: CPU 0 calls tlb_shootdown_mask() for the CPUs 0 .. n-1 and ranges 
+ * of 1 .. 1024 pages of p_buffer [cycles per shootdown]. The other CPUs wait in the barrier
+ * and take the requests there (smp_call_poll(), so the latency depends on the wait policy).
+ */
+#define BENCH_SHOOTDOWN_ITER    100
+
+void bench_shootdown(void *p_buffer)
+{
+    static const unsigned pages[] = {1, 4, 16, 64, 256, 1024};
+    const unsigned cnt = sizeof(pages) / sizeof(pages[0]);
+    unsigned n, i, k;
+    uint64_t tsc;
+    cpumask_t mask;
+
+    if (CPU_ID == 0) {
+        printf("TLB shootdown [cycles] (CR3 reload above %u pages) --------------------------\n", TLB_FLUSH_MAX_PAGES);
+        printf("CPUs pages:");
+        for (i = 0; i < cnt; i++) printf(" %7u", pages[i]);
+        printf("\n");
+    }
+    for (n = 1; n <= cpu_online; n++) {
+        if (CPU_ID == 0) {
+            cpumask_fill(&mask, n);
+            printf("%4u       ", n);
+            for (i = 0; i < cnt; i++) {
+                tsc = rdtsc();
+                for (k = 0; k < BENCH_SHOOTDOWN_ITER; k++) {
+                    tlb_shootdown_mask(&mask, p_buffer, pages[i] * PAGE_SIZE);
+                }
+                printf(" %7u", (unsigned long)((rdtsc() - tsc) / BENCH_SHOOTDOWN_ITER));
+            }
+            printf("\n");
+        }
+        barrier(&global_barrier);
+    }
+}
+
+/*
+ * Core-to-core cache-line transfer for every pair of CPUs (s in the rows, r in the columns):
+ *  - latency: s stores to a line, r spins until it sees the value and stores the answer 
+ *    [cycles per one-way transfer = round-trip / 2]
+ *  - bandwidth (optional): s writes BENCH_C2C_LINES lines, r reads them all and signals a flag
+ *    [MB/s, lines in flight]
+ * Low latencies show SMT siblings and CPUs sharing a cache level, steps show the boundaries.
+ */
+#define BENCH_C2C_ITER      1000
+#define BENCH_C2C_LINES     64
+#define BENCH_C2C_ROUNDS    200
+#define BENCH_C2C_WORDS     (CACHE_LINE / sizeof(unsigned long))
+
+static volatile unsigned long c2c_line[BENCH_C2C_WORDS] __attribute__((aligned(CACHE_LINE)));
+static volatile unsigned long c2c_block[BENCH_C2C_LINES][BENCH_C2C_WORDS] __attribute__((aligned(CACHE_LINE)));
+
+static void bench_c2c_latency(unsigned s, unsigned r)
+{
+    unsigned long i;
+    uint64_t tsc;
+
+    if (CPU_ID == s) {
+        tsc = rdtsc();
+        for (i = 0; i < BENCH_C2C_ITER; i++) {
+            c2c_line[0] = 2*i + 1;
+            while (c2c_line[0] != 2*i + 2) ;
+        }
+        bench_row[r] = (rdtsc() - tsc) / (2 * BENCH_C2C_ITER);
+    } else if (CPU_ID == r) {
+        for (i = 0; i < BENCH_C2C_ITER; i++) {
+            while (c2c_line[0] != 2*i + 1) ;
+            c2c_line[0] = 2*i + 2;
+        }
+    }
+}
+
+static void bench_c2c_bandwidth(unsigned s, unsigned r, flag_t *done)
+{
+    unsigned long n;
+    unsigned l;
+    uint64_t tsc;
+
+    if (CPU_ID == s) {
+        tsc = rdtsc();
+        for (n = 1; n <= BENCH_C2C_ROUNDS; n++) {
+            for (l = 0; l < BENCH_C2C_LINES; l++) c2c_block[l][0] = n;
+            flag_wait(done);
+        }
+        tsc = rdtsc() - tsc;
+        /* bytes per us = MB/s */
+        bench_row[r] = (unsigned long)((uint64_t)BENCH_C2C_ROUNDS * BENCH_C2C_LINES * CACHE_LINE 
+                * hw_info.tsc_per_usec / (tsc ? tsc : 1));
+    } else if (CPU_ID == r) {
+        for (n = 1; n <= BENCH_C2C_ROUNDS; n++) {
+            for (l = 0; l < BENCH_C2C_LINES; l++) {
+                while (c2c_block[l][0] != n) ;
+            }
+            flag_signal(done);
+        }
+    }
+}
+
+void bench_c2c(unsigned bandwidth)
+{
+    static flag_t done = FLAG_INITIALIZER;
+    unsigned s, r, l, type;
+
+    if (cpu_online < 2) {
+        if (CPU_ID == 0) printf("bench_c2c: needs more than one CPU\n");
+        return;
+    }
+    for (type = 0; type <= (bandwidth ? 1 : 0); type++) {
+        if (CPU_ID == 0) {
+            if (type == 0) bench_matrix_head("cache-line transfer latency [cycles] --------------------------");
+            else bench_matrix_head("cache-line transfer bandwidth [MB/s] --------------------------");
+        }
+        for (s = 0; s < cpu_online; s++) {
+            for (r = 0; r < cpu_online; r++) {
+                if (CPU_ID == 0) {
+                    bench_row[r] = 0;
+                    c2c_line[0] = 0;
+                    for (l = 0; l < BENCH_C2C_LINES; l++) c2c_block[l][0] = 0;
+                    flag_init(&done);
+                }
+                barrier(&global_barrier);
+                if (r == s) continue;
+                if (type == 0) bench_c2c_latency(s, r);
+                else bench_c2c_bandwidth(s, r, &done);
+            }
+            barrier(&global_barrier);
+            if (CPU_ID == 0) bench_matrix_row(s);
+        }
+    }
+}
+
+/*
+ * Timer jitter: every CPU programs its local APIC timer BENCH_TIMER_ITER times and halts until
+ * the interrupt. Reported is the time from the programmed deadline to the handler entry [cycles]
+ * (periodic: the deviation of the interval between two interrupts from the period).
+ */
+#define BENCH_TIMER_ITER    1000
+#define BENCH_TIMER_US      100
+
+static char *bench_timer_name[] = {"one-shot", "deadline", "periodic"};
+
+/* halt until the next timer interrupt (count changes from *last) */
+static void bench_timer_wait(unsigned long *last)
+{
+    volatile cpu_info_t *info = my_cpu_info();
+    while (info->timer_cnt == *last) {
+        __asm__ volatile ("sti; hlt; cli" ::: "memory");
+    }
+    *last = info->timer_cnt;
+}
+
+void bench_timer()
+{
+    static volatile unsigned long early;
+    volatile cpu_info_t *info = my_cpu_info();
+    sync_stat_t *s = &sync_stat[CPU_ID];
+    const uint64_t period = (uint64_t)BENCH_TIMER_US * hw_info.tsc_per_usec;
+    unsigned mode, i, if_backup;
+    unsigned long last;
+    uint64_t deadline, prev = 0;
+
+    if (!apic_timer_ok()) return;
+    if (CPU_ID == 0) printf("APIC timer jitter (%u us, %u interrupts per CPU) [cycles] --------------\n", 
+            BENCH_TIMER_US, BENCH_TIMER_ITER);
+
+    if_backup = cli();
+    for (mode = 0; mode < 3; mode++) {
+        if (mode == 1 && !apic_timer_has_deadline()) {
+            if (CPU_ID == 0) printf("%-10s not supported\n", bench_timer_name[mode]);
+            continue;
+        }
+        if (CPU_ID == 0) early = 0;
+        sync_stat_start();
+        last = info->timer_cnt;
+        if (mode == 2) {
+            apic_timer_periodic(BENCH_TIMER_US);
+            bench_timer_wait(&last);
+            prev = info->timer_tsc;
+        }
+        for (i = 0; i < BENCH_TIMER_ITER; i++) {
+            if (mode == 2) {
+                bench_timer_wait(&last);
+                deadline = prev + period;
+                prev = info->timer_tsc;
+            } else {
+                deadline = rdtsc() + period;
+                apic_timer_at(deadline, mode);
+                bench_timer_wait(&last);
+            }
+            if (info->timer_tsc >= deadline) {
+                sync_stat_add(s, info->timer_tsc - deadline);
+            } else {
+                /* one-shot too early (timer ticks rounded) or periodic: deviation to the other side */
+                sync_stat_add(s, deadline - info->timer_tsc);
+                __sync_add_and_fetch(&early, 1);
+            }
+        }
+        apic_timer_stop();
+        sync_stat_report(bench_timer_name[mode], cpu_online);
+        if (CPU_ID == 0 && early) printf("%-10s %u interrupts before the deadline\n", bench_timer_name[mode], early);
+    }
+    if (if_backup) sti();
+    barrier(&global_barrier);
+}
+
+/*
+ * Isolation profile: CPU 1 runs the hourglass with interrupts enabled and a 1 ms local APIC
+ * tick (like the scheduler tick of an OS), first as it is, then isolated by irq_isolate()
+ * (device interrupts to CPU 0, LVTs masked). The interrupts counted on CPU 1 should drop to 0.
+ */
+#define BENCH_ISOLATION_TICK_US 1000
+
+void bench_isolation()
+{
+    static barrier_t barr2 = BARRIER_INITIALIZER(2);
+    cpumask_t mask, bench;
+    unsigned run, if_backup;
+    unsigned long cnt, n;
+
+    if (cpu_online < 2 || !apic_timer_ok()) {
+        if (CPU_ID == 0) printf("bench_isolation: needs more than one CPU and the APIC timer\n");
+        return;
+    }
+    if (CPU_ID == 0) printf("isolation: hourglass on CPU 1, %u us tick (%u sec) -------------------------\n", 
+            BENCH_ISOLATION_TICK_US, bench_opt.timebase);
+    barrier(&global_barrier);
+
+    cpumask_fill(&mask, 2);
+    if (collective_only(&mask)) {       /* IDs 0 and 1 */
+        cpumask_clear(&bench);
+        cpumask_set(&bench, 1);
+
+        for (run = 0; run < 2; run++) {
+            if (CPU_ID == 1) apic_timer_periodic(BENCH_ISOLATION_TICK_US);
+            barrier(&barr2);
+            if (CPU_ID == 0 && run) irq_isolate(&bench);
+            barrier(&barr2);
+
+            if (CPU_ID == 1) {
+                printf("%-10s ", run ? "isolated" : "tick");
+                cnt = my_cpu_info()->irq_cnt;
+                if_backup = sti();
+                hourglass(bench_opt.timebase);
+                if (!if_backup) cli();
+                apic_timer_stop();
+                printf("  interrupts: %u\n", my_cpu_info()->irq_cnt - cnt);
+            }
+            barrier(&barr2);
+            if (CPU_ID == 0 && run) {
+                n = irq_unisolate();
+                if (n) printf("WARNING: %u interrupts on isolated CPUs\n", n);
+            }
+            barrier(&barr2);
+        }
+
+        collective_end();
+    }
+}
@@ -68,5 +68,19 @@ void bench_worker(void *p_buffer, void *p_contender);
 void bench_worker_cut(void *p_buffer, void *p_contender, size_t worker_size);
 void bench_rangestride(void *p_buffer);
 void bench_mem(void *p_buffer, void *p_contender);
+void bench_lock();
+void bench_lock_fairness();
+void bench_barrier();
+void bench_wait();
+void bench_sync();
+void bench_spsc();
+void bench_mpmc();
+void bench_task(void *p_buffer);
+void bench_ipi();
+void bench_shootdown(void *p_buffer);
+void bench_c2c(unsigned bandwidth);
+void bench_timer();
+void bench_isolation();
+void bench_tlb();
 
 #endif  // BENCHMARK_H
@@ -78,6 +78,14 @@ static inline void halt()
     }
 }
 
+/* number of bits needed for the values 0 .. x-1 (the width of an APIC ID field) */
+static unsigned log2_ceil(unsigned x)
+{
+    unsigned bits = 0;
+    while ((1u << bits) < x) bits++;
+    return bits;
+}
+
 /*
  * read CPU features (mostly from CPUID)
  * see: http://osdev.berlios.de/cpuid.html
@@ -146,6 +154,10 @@ static void cpu_features()
 
         }
     }
+    if (hw_info.cpuid_max >= 1) {
+        cpuid(1);
+        hw_info.cpuid_x2apic = (ecx >> 21) & 1;     /* same for Intel and AMD */
+    }
     printf("cache line size: %u, local APIC id: %u\n", hw_info.cpuid_cachelinesize, hw_info.cpuid_lapic_id);
 
     *pStatus = 0x0F00 + 'c';
@@ -222,6 +234,62 @@ static void cpu_features()
         }
     }
 
+    /*
+     * get the width of the SMT and core fields in the APIC ID
+     *  - Intel: Function 0x1F or 0xB (extended topology), alternatively Functions 1 and 4
+     *    (0x1F may add module, tile and die levels: they are counted to the core field)
+     *  - AMD: Function 0x8000_0008, SMT from Function 0x8000_001E (TopologyExtensions)
+     */
+    if (hw_info.cpu_vendor == vend_intel) {
+        unsigned leaf = 0;
+        if (hw_info.cpuid_max >= 0x1F && (cpuid_ext(0x1F, 0), ebx != 0)) leaf = 0x1F;
+        else if (hw_info.cpuid_max >= 0x0B && (cpuid_ext(0x0B, 0), ebx != 0)) leaf = 0x0B;
+        if (leaf) {
+            /* use Function 0x1F or 0xB: the shift of the last level is the one of the package ID */
+            unsigned u = 0;
+            unsigned type;
+            while (u < 8) {
+                cpuid_ext(leaf, u);
+                type = BITS_FROM_CNT(ecx, 8, 8);
+                if (type == 0) break;
+                if (type == 1) hw_info.topo_smt_bits = BITS_FROM_CNT(eax, 0, 5);
+                else hw_info.topo_core_bits = BITS_FROM_CNT(eax, 0, 5);
+                u++;
+            }
+            if (hw_info.topo_core_bits < hw_info.topo_smt_bits) {
+                hw_info.topo_core_bits = hw_info.topo_smt_bits;
+            }
+        } else if (hw_info.cpuid_max >= 4) {
+            /* use Functions 1 and 4 */
+            unsigned logical, cores;
+            cpuid(1);
+            logical = IS_BIT_SET(edx, 28) ? BITS_FROM_CNT(ebx, 16, 8) : 1;
+            cpuid_ext(4, 0);
+            cores = BITS_FROM_CNT(eax, 26, 6) +1;
+            if (cores > logical) cores = logical;
+            hw_info.topo_core_bits = log2_ceil(logical);
+            hw_info.topo_smt_bits = log2_ceil(logical / cores);
+        }
+    } else if (hw_info.cpu_vendor == vend_amd) {
+        if (hw_info.cpuid_high_max >= 0x80000008) {
+            cpuid(0x80000008);
+            hw_info.topo_core_bits = BITS_FROM_CNT(ecx, 12, 4);
+            if (hw_info.topo_core_bits == 0) {
+                hw_info.topo_core_bits = log2_ceil(BITS_FROM_CNT(ecx, 0, 8) +1);
+            }
+        }
+        if (hw_info.cpuid_high_max >= 0x8000001E && (cpuid(0x80000001), IS_BIT_SET(ecx, 22))) {
+            /* TopologyExtensions: EBX[15:8] threads per core - 1 */
+            cpuid(0x8000001E);
+            hw_info.topo_smt_bits = log2_ceil(BITS_FROM_CNT(ebx, 8, 8) +1);
+            if (hw_info.topo_core_bits < hw_info.topo_smt_bits) {
+                hw_info.topo_core_bits = hw_info.topo_smt_bits;
+            }
+        }
+    }
+    printf("APIC ID topology: SMT bits: %u, core bits: %u\n", 
+            (unsigned)hw_info.topo_smt_bits, (unsigned)hw_info.topo_core_bits);
+
     *pStatus = 0x0F00 + 'f';
 
     /*
@@ -257,7 +325,7 @@ static void cpu_features()
                 hw_info.cpuid_cache[u].level = BITS_FROM_CNT(eax, 5, 3);
                 printf(" L%u", hw_info.cpuid_cache[u].level);
 
-                hw_info.cpuid_cache[u].shared_by = BITS_FROM_CNT(eax, 26, 6)+1;
+                hw_info.cpuid_cache[u].shared_by = BITS_FROM_CNT(eax, 14, 12)+1;
                 printf(" shared by %u threads", hw_info.cpuid_cache[u].shared_by);
 
                 way = BITS_FROM_CNT(ebx, 22, 10)+1;
@@ -345,12 +413,44 @@ static void cpu_features()
                         hw_info.cpuid_cache[3].line_size);
             }
 
+            /* sharing: L1 and L2 per core, L3 per package (Function 0x8000_001D tells better) */
+            hw_info.cpuid_cache[0].shared_by = 1u << hw_info.topo_smt_bits;
+            hw_info.cpuid_cache[1].shared_by = 1u << hw_info.topo_smt_bits;
+            hw_info.cpuid_cache[2].shared_by = 1u << hw_info.topo_smt_bits;
+            hw_info.cpuid_cache[3].shared_by = 1u << hw_info.topo_core_bits;
+            if (hw_info.cpuid_high_max >= 0x8000001D && (cpuid(0x80000001), IS_BIT_SET(ecx, 22))) {
+                /* same layout as Intel's Function 4 */
+                unsigned u, v;
+                for (u = 0; u < 8; u++) {
+                    cpuid_ext(0x8000001D, u);
+                    if (BITS_FROM_CNT(eax, 0, 5) == 0) break;
+                    for (v = 0; v < 4; v++) {
+                        if (hw_info.cpuid_cache[v].level == BITS_FROM_CNT(eax, 5, 3)
+                                && (hw_info.cpuid_cache[v].type == 'I') == (BITS_FROM_CNT(eax, 0, 5) == 2)) {
+                            hw_info.cpuid_cache[v].shared_by = BITS_FROM_CNT(eax, 14, 12)+1;
+                        }
+                    }
+                }
+            }
+
         } else {
             printf("no cache info for AMD found\n");
         }
 
     }
 
+    /* caches with the same APIC ID >> id_shift are shared (see topo_init_cpu()) */
+    {
+        unsigned u;
+        for (u = 0; u < MAX_CACHE; u++) {
+            hw_info.cpuid_cache[u].id_shift = log2_ceil(hw_info.cpuid_cache[u].shared_by);
+            if (hw_info.cpuid_cache[u].size > 0) {
+                printf("L%u%c shared by %u APIC IDs\n", hw_info.cpuid_cache[u].level, 
+                        hw_info.cpuid_cache[u].type, hw_info.cpuid_cache[u].shared_by);
+            }
+        }
+    }
+
     *pStatus = 0x0F00 + ' ';
 
 }
@@ -407,6 +507,23 @@ static int check_sum(void *hdr, size_t length)
  * contains information about the number of enabled processors and
  * the I/O APICs.
  */
+/*
+ * add a CPU from the MADT (Local APIC or x2APIC entry; the firmware may list a CPU 
+ * in both, if its ID is below 255)
+ */
+static void madt_add_cpu(uint32_t lapic_id)
+{
+    unsigned u;
+
+    for (u = 0; u < hw_info.cpu_cnt; u++) {
+        if (hw_info.cpu[u].lapic_id == lapic_id) return;
+    }
+    if (hw_info.cpu_cnt < MAX_CPU) {
+        hw_info.cpu[hw_info.cpu_cnt].lapic_id = lapic_id;
+        hw_info.cpu_cnt++;
+    }
+}
+
 static int read_madt(ptr_t offset)
 {
     madt_t *madt = (madt_t*)offset;
@@ -426,18 +543,23 @@ static int read_madt(ptr_t offset)
         unsigned subtype = madt->apic_structs[i];   /* first byte is type of entry */
         unsigned sublen = madt->apic_structs[i+1];  /* second byte is size of entry */
         madt_lapic_t *lapic;
+        madt_x2apic_t *x2apic;
         madt_ioapic_t *ioapic;
+        madt_intsrc_t *intsrc;
 
         switch (subtype) {
             case MADT_TYPE_LAPIC :
                 lapic = (madt_lapic_t*)(ptr_t)&madt->apic_structs[i];
-                if (lapic->flags.enabled) {
-                    hw_info.cpu[hw_info.cpu_cnt].lapic_id = lapic->apic_id;
-                    hw_info.cpu_cnt++;
-                }
+                if (lapic->flags.enabled) madt_add_cpu(lapic->apic_id);
                 IFV printf("CPU id=%u  enabled: %u local APIC id: %u\n", 
                         (ptr_t)lapic->acpi_processor_id, (ptr_t)lapic->flags.enabled, (ptr_t)lapic->apic_id);
                 break;
+            case MADT_TYPE_X2APIC :
+                x2apic = (madt_x2apic_t*)(ptr_t)&madt->apic_structs[i];
+                if (x2apic->flags.enabled) madt_add_cpu(x2apic->x2apic_id);
+                IFV printf("CPU uid=%u  enabled: %u x2APIC id: %u\n", 
+                        (ptr_t)x2apic->acpi_processor_uid, (ptr_t)x2apic->flags.enabled, (ptr_t)x2apic->x2apic_id);
+                break;
             case MADT_TYPE_IOAPIC :
                 ioapic = (madt_ioapic_t*)(ptr_t)&madt->apic_structs[i];
                 hw_info.ioapic[hw_info.ioapic_cnt].id = ioapic->ioapic_id;
@@ -445,6 +567,15 @@ static int read_madt(ptr_t offset)
                 hw_info.ioapic_cnt++;
                 IFV printf("I/O APIC id=%u  adr: 0x%x\n", (ptr_t)ioapic->ioapic_id, (ptr_t)ioapic->ioapic_adr);
                 break;
+            case MADT_TYPE_INTSRC :
+                intsrc = (madt_intsrc_t*)(ptr_t)&madt->apic_structs[i];
+                if (intsrc->bus == 0 && intsrc->source < 16) {     /* bus 0: ISA */
+                    hw_info.isa_gsi[intsrc->source] = intsrc->gsi;
+                    hw_info.isa_flags[intsrc->source] = intsrc->flags.polarity | (intsrc->flags.trigger_mode << 2);
+                }
+                IFV printf("ISA IRQ %u -> GSI %u  flags: 0x%x\n", (ptr_t)intsrc->source, (ptr_t)intsrc->gsi,
+                        (ptr_t)(intsrc->flags.polarity | (intsrc->flags.trigger_mode << 2)));
+                break;
 
         }
         i += sublen;
@@ -550,6 +681,7 @@ void get_info()
     hw_info.cmd_cpumask = 0xFFFFFFFF;      /* default: all CPUs */
     hw_info.cmd_maxcpu = MAX_CPU;
     hw_info.tsc_per_usec = TSC_PER_USEC;            /* for 2.6 GHz CPU, used before calibration (see pit.c) */
+    for (i = 0; i < 16; i++) hw_info.isa_gsi[i] = i;   /* ISA IRQs without override: same I/O APIC input */
 
     /*
      * check, what CPUID functions are available
@@ -716,20 +848,28 @@ skip_acpi:
 
     hw_info.cpu_cnt = 0;
     hw_info.ioapic_cnt = 0;
+    hw_info.bus_isa_id = 0xFF;      /* none (until the ISA bus entry) */
     uint8_t *type = (uint8_t*)((ptr_t)config + sizeof(mps_config_t));
     for (i=0; i < config->cnt_oem; i++) {
         mps_conf_processor_t *processor;
         mps_conf_ioapic_t *ioapic;
+        mps_conf_bus_t *bus;
+        mps_conf_int_t *intr;
         switch (*type) {
             case 0 :
                 processor = (mps_conf_processor_t*)type;
                 IFVV printf("CPU %u\n", processor->lapic_id);
-                if (processor->flags.en) {
+                if (processor->flags.en && hw_info.cpu_cnt < MAX_CPU) {
                     hw_info.cpu[hw_info.cpu_cnt].lapic_id = processor->lapic_id;
                     hw_info.cpu_cnt++;
                 }
                 type += sizeof(mps_conf_processor_t);
                 break;
+            case 1 :
+                bus = (mps_conf_bus_t*)type;
+                if (strncmp((char*)bus->bus_type, "ISA", 3) == 0) hw_info.bus_isa_id = bus->bus_id;
+                type += sizeof(mps_conf_bus_t);
+                break;
             case 2 :
                 ioapic = (mps_conf_ioapic_t*)type;
                 IFVV printf("I/O APIC %u  0x%x\n", ioapic->ioapic_id, ioapic->adr_ioapic);
@@ -740,6 +880,15 @@ skip_acpi:
                 }
                 type += sizeof(mps_conf_ioapic_t);
                 break;
+            case 3 :
+                intr = (mps_conf_int_t*)type;
+                /* INT (vectored) entries of the ISA bus (the bus entries come first) */
+                if (intr->int_type == 0 && intr->src_bus_id == hw_info.bus_isa_id && intr->src_bus_irq < 16) {
+                    hw_info.isa_gsi[intr->src_bus_irq] = intr->dest_apic_intin;
+                    hw_info.isa_flags[intr->src_bus_irq] = intr->flags.po | (intr->flags.el << 2);
+                }
+                type += sizeof(mps_conf_int_t);
+                break;
             default :
                 type += 8;  /* all entries except processor are 8 bytes long */
 
@@ -760,6 +909,20 @@ skip_mps:
     }
     IFV printf("found %d CPUs and %d I/O APICs\n", (ptr_t)hw_info.cpu_cnt, (ptr_t)hw_info.ioapic_cnt);
 
+    /*
+     * split the APIC IDs into SMT, core and package IDs
+     * (preliminary, from the MADT: every CPU decodes its own APIC ID in topo_init_cpu() when it starts)
+     */
+    for (i=0; i < hw_info.cpu_cnt; i++) {
+        uint32_t id = hw_info.cpu[i].lapic_id;
+        hw_info.cpu[i].smt_id = BITS_FROM_CNT(id, 0, hw_info.topo_smt_bits);
+        hw_info.cpu[i].core_id = BITS_FROM_CNT(id >> hw_info.topo_smt_bits, 0, 
+                hw_info.topo_core_bits - hw_info.topo_smt_bits);
+        hw_info.cpu[i].package_id = id >> hw_info.topo_core_bits;
+        IFVV printf("CPU %u: package %u core %u smt %u\n", i, (unsigned)hw_info.cpu[i].package_id,
+                (unsigned)hw_info.cpu[i].core_id, (unsigned)hw_info.cpu[i].smt_id);
+    }
+
 
     return;
 }
@@ -48,8 +48,17 @@
 
 /*
  * number of supported CPUs (maximum)
+ * The actual number is taken from the MADT at boot: the APs' stacks are allocated
+ * for those only (identity mapped between 2 and 4 MB: at most 256 with STACK_FRAMES 2),
+ * MAX_CPU just bounds the static per-CPU tables.
  */
-#define MAX_CPU   16
+#define MAX_CPU   256
+
+/*
+ * cache line size (used to pad shared synchronization data, so that
+ * every CPU spins on its own line)
+ */
+#define CACHE_LINE 64
 
 /*
  * number of supported I/O APICs (maximum)
@@ -71,6 +80,21 @@
  */
 #define SMP_FRAME  0x88
 
+/*
+ * SMP_STARTUP - how the APs are started
+ *     0 - one after the other (INIT-SIPI-SIPI per AP, honors the cmdline's cpumask)
+ *     1 - all at once (broadcast INIT-SIPI-SIPI to all excluding self, 
+ *         every AP claims its number and stack atomically)
+ */
+#define SMP_STARTUP 1
+
+/*
+ * X2APIC - mode of the local APICs
+ *     0 - xAPIC (memory mapped registers, 8 bit APIC IDs)
+ *     1 - x2APIC if CPUID reports it (MSR access, single ICR write, 32 bit APIC IDs)
+ */
+#define X2APIC     1
+
 /*
  * maximum supported memory (currently 2 GB)
  * ATTN: ulong is 32 bit on __x86_32__, so 4GB==0 (overflow), max value would be 4GB-1, but that's not page-aligned...
@@ -82,6 +106,19 @@
  */
 #define STACK_FRAMES   2
 
+/*
+ * TLB_FLUSH_MAX_PAGES - tlb_flush()/tlb_shootdown() invalidate ranges up to this 
+ * number of pages with invlpg, larger ranges by reloading CR3 (whole TLB)
+ */
+#define TLB_FLUSH_MAX_PAGES 32
+
+/*
+ * APIC_TIMER_DEADLINE - mode of the local APIC timer for the timer queue (time.h)
+ *     0 - one-shot (TSC values are converted to timer ticks)
+ *     1 - TSC-deadline, if supported (else one-shot)
+ */
+#define APIC_TIMER_DEADLINE 1
+
 /*
  * verbosity: set to 0 (off), 1 (normal), 2 (chatter)
  * VERBOSE (first line) has global effect over all subsequent settings
@@ -107,6 +144,43 @@
  */
 #define OFFER_MENU          2
 
+/*
+ * KERNEL_LOCK - lock used for the contended kernel locks 
+ *               (mutex_printf, pci_mutex), see sync.h:klock_t
+ *     0 - mutex_t (test-and-set spinlock)
+ *     1 - mcslock_t (MCS queue lock: FIFO order, local spinning)
+ *     2 - ticketlock_t (ticket lock: FIFO order, proportional backoff)
+ */
+#define KERNEL_LOCK         0
+
+/*
+ * WAIT_* - default wait policy of barrier(), flag_wait() and mutex_lock()
+ * (see sync.h, can be changed at runtime in wait_policy[])
+ *     0 - spin (tight loop)
+ *     1 - pause-spin
+ *     2 - bounded exponential backoff
+ *     3 - MONITOR/MWAIT (pause-spin if not supported)
+ *     4 - pause-spin, then hlt until woken by IPI
+ */
+#define WAIT_BARRIER        1
+#define WAIT_FLAG           1
+#define WAIT_MUTEX          2
+
+/*
+ * SYNC_STATS - lock and barrier statistics (see sync.h)
+ *     0 - off (no overhead)
+ *     1 - record acquisitions, contention, spin and hold times, barrier arrival skew
+ */
+#define SYNC_STATS          0
+
+/*
+ * BARRIER_TYPE - algorithm of barrier() (see sync.h)
+ *     0 - central counter (all CPUs on one cache line)
+ *     1 - combining tree (per-node cache lines, tree release)
+ *     2 - topology-aware tree (SMT siblings, then cores, then packages)
+ */
+#define BARRIER_TYPE        2
+
 
 /*
  * scrollback buffer
@@ -154,4 +228,12 @@
 #define BENCH_RANGESTRIDE_REP   (256*1024*1024)
 #endif
 
+/*
+ * BENCH_PAGE_FLAGS - page size of the benchmark buffers (p_buffer, p_contender, see payload.c)
+ *     0           - 4 kB pages (TLB misses above a few MB)
+ *     MM_HUGE     - 2 MB pages (64 bit) or 4 MB pages (32 bit)
+ *     MM_HUGE_1G  - 1 GB pages (64 bit), if supported
+ */
+#define BENCH_PAGE_FLAGS        0
+
 #endif 
@@ -68,12 +68,12 @@ char *vendor_string[] = {"unknown", "Intel", "AMD"};
 
 void reboot()
 {
-    int s= 9 + cpu_online, i;
+    int s= 9 + smp_status_cols(), i;
     char msg[] = "Reboot in                  ";
     char *m = &msg[0];
     
     while (*m != 0) status_putch(s++, *m++);
-    s = 9 + cpu_online + 10;
+    s = 9 + smp_status_cols() + 10;
 
     for (i=1; i<=5; i++) {
         status_putch(s++, '6'-i);
@@ -134,6 +134,9 @@ void stop()
     if (cpus_halted < cpu_online) {
         while (1) __asm__ volatile ("hlt");
     } else {
+#       if SYNC_STATS
+            sync_stats_print();
+#       endif
 #       if SCROLLBACK_BUF_SIZE
             smm_restore(SMM_DEFAULT);
             video_scrollback();
@@ -143,3 +146,67 @@ void stop()
 
 }
 		
+
+/*
+ * CPU topology
+ */
+
+/* index of the data or unified cache of a level in hw_info.cpuid_cache[] (-1: none) */
+static int topo_cache(unsigned level)
+{
+    unsigned u;
+    for (u = 0; u < MAX_CACHE; u++) {
+        if (hw_info.cpuid_cache[u].level == level && hw_info.cpuid_cache[u].type != 'I' 
+                && hw_info.cpuid_cache[u].size > 0) return u;
+    }
+    return -1;
+}
+
+void topo_init_cpu(unsigned id, uint32_t lapic_id)
+{
+    unsigned level;
+    int c;
+
+    hw_info.cpu[id].lapic_id = lapic_id;
+    hw_info.cpu[id].smt_id = BITS_FROM_CNT(lapic_id, 0, hw_info.topo_smt_bits);
+    hw_info.cpu[id].core_id = BITS_FROM_CNT(lapic_id >> hw_info.topo_smt_bits, 0, 
+            hw_info.topo_core_bits - hw_info.topo_smt_bits);
+    hw_info.cpu[id].package_id = lapic_id >> hw_info.topo_core_bits;
+    for (level = 1; level <= 3; level++) {
+        c = topo_cache(level);
+        /* unknown cache: not shared (unique ID) */
+        hw_info.cpu[id].cache_id[level-1] = (c < 0) ? lapic_id : lapic_id >> hw_info.cpuid_cache[c].id_shift;
+    }
+}
+
+int topo_same_core(unsigned a, unsigned b)
+{
+    return hw_info.cpu[a].package_id == hw_info.cpu[b].package_id 
+        && hw_info.cpu[a].core_id == hw_info.cpu[b].core_id;
+}
+
+int topo_same_cache(unsigned a, unsigned b, unsigned level)
+{
+    if (level < 1 || level > 3) return 0;
+    return hw_info.cpu[a].cache_id[level-1] == hw_info.cpu[b].cache_id[level-1];
+}
+
+int topo_same_package(unsigned a, unsigned b)
+{
+    return hw_info.cpu[a].package_id == hw_info.cpu[b].package_id;
+}
+
+unsigned topo_sibling(unsigned cpu)
+{
+    unsigned u;
+    for (u = 0; u < cpu_online; u++) {
+        if (u != cpu && topo_same_core(u, cpu)) return u;
+    }
+    return MAX_CPU;
+}
+
+size_t topo_cache_size(unsigned level)
+{
+    int c = topo_cache(level);
+    return (c < 0) ? 0 : hw_info.cpuid_cache[c].size;
+}
@@ -111,6 +111,22 @@ static void wrmsr(uint32_t msr, uint64_t value) {
 void reboot();
 void stop();
 
+/*
+ * CPU topology (from the APIC IDs, with the field widths found by boot32.c)
+ * topo_init_cpu() is called by every CPU for itself (see apic.c); then for CPU numbers a and b:
+ *  - topo_same_core(): SMT siblings (or a == b)
+ *  - topo_same_cache(): they share the cache of that level (1..3)
+ *  - topo_same_package(): same socket
+ * topo_sibling() returns the first other online CPU on the same core (MAX_CPU: none),
+ * topo_cache_size() the size of the data/unified cache of a level (0: none).
+ */
+void topo_init_cpu(unsigned id, uint32_t lapic_id);
+int topo_same_core(unsigned a, unsigned b);
+int topo_same_cache(unsigned a, unsigned b, unsigned level);
+int topo_same_package(unsigned a, unsigned b);
+unsigned topo_sibling(unsigned cpu);
+size_t topo_cache_size(unsigned level);
+
 inline static unsigned sti(void) {
     ptr_t flags;
     __asm__ volatile ("pushf; sti; pop %0" : "=r"(flags) : : "memory");
@@ -129,6 +145,27 @@ inline static void mfence(void)
     __asm__ volatile ("mfence");
 }
 
+/* spin-loop hint: saves power and leaves resources to the SMT sibling */
+inline static void pause(void) 
+{
+    __asm__ volatile ("pause" ::: "memory");
+}
+
+/* arm the address monitor on the cache line of adr (check CPUID.1:ECX[3] first) */
+inline static void monitor(volatile void *adr) 
+{
+    __asm__ volatile ("monitor" : : "a"(adr), "c"(0), "d"(0) : "memory");
+}
+
+/* 
+ * wait until the monitored line is written (or an interrupt arrives)
+ * ext = 1: masked interrupts wake up, too (check CPUID.5:ECX[1] first)
+ */
+inline static void mwait(unsigned ext) 
+{
+    __asm__ volatile ("mwait" : : "a"(0), "c"(ext) : "memory");
+}
+
 inline static void cpuid(uint32_t func, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
     __asm__ volatile ("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(func));
 }
@@ -45,6 +45,8 @@
 #include "info_struct.h"
 #include "menu.h"
 #include "apic.h"
+#include "smp.h"
+#include "sync.h"
 
 void info_menu(void)
 {
@@ -52,6 +54,7 @@ void info_menu(void)
     do {
         menu_entry_t infomenu[] = {
             {1, "localAPIC"},
+            {2, "sync statistics"},
             {999, "return"},
             {0,0}
         };
@@ -60,6 +63,9 @@ void info_menu(void)
             case 1 :
                 print_apic();
                 break;
+            case 2 :
+                if (CPU_ID == 0) sync_stats_print();
+                break;
         }
     } while (t != 999);
 
@@ -74,10 +74,14 @@ typedef struct {
         uint32_t u32[12];
     } cpuid_processor_name;
     uint16_t cpuid_threads_per_package;
+    uint8_t topo_smt_bits;      /* width of the SMT ID in the APIC ID */
+    uint8_t topo_core_bits;     /* width of SMT and core ID in the APIC ID (package ID starts here) */
+    uint8_t cpuid_x2apic;       /* x2APIC supported (CPUID.01h:ECX[bit 21]) */
     struct {
         uint8_t level;
         char type;      // Data, Instruction, Unified
-        uint8_t shared_by;
+        uint16_t shared_by;     // max. number of APIC IDs sharing this cache
+        uint8_t id_shift;       // cache ID = APIC ID >> id_shift (log2 of shared_by)
         uint8_t line_size;
         uint32_t size;
         // associativity... (n-way)?
@@ -91,11 +95,17 @@ typedef struct {
     uint32_t cpu_cnt;
     struct {
         uint32_t lapic_id;
+        uint16_t package_id;    /* decoded from lapic_id (see topo_*_bits) */
+        uint16_t core_id;
+        uint16_t smt_id;
+        uint32_t cache_id[3];   /* L1 .. L3 cache ID: equal on CPUs sharing that cache (see topo_*() in cpu.h) */
     } cpu[MAX_CPU];
     uint32_t lapic_adr;
 
     /* BUS */
     uint32_t bus_isa_id;        /* what bus-id has the ISA bus (for redirecting the IRQs) */
+    uint8_t isa_gsi[16];        /* ISA IRQ -> I/O APIC input (identity, unless overridden by ACPI/MPS) */
+    uint8_t isa_flags[16];      /* MPS INTI flags of the ISA IRQ: polarity (bits 0-1), trigger mode (bits 2-3) */
 
     /* I/O APICs */
     uint32_t ioapic_cnt;
@@ -43,6 +43,7 @@
  */
 #include "system.h"
 #include "smp.h"
+#include "time.h"
 
 #define IFV   if (VERBOSE > 0 || VERBOSE_ISR > 0)
 #define IFVV  if (VERBOSE > 1 || VERBOSE_ISR > 1)
@@ -81,7 +82,33 @@ extern void isr30();
 extern void isr31();
 
 extern void isr47();
+extern void isr64();
+extern void isr65();
+extern void isr66();
+extern void isr67();
+extern void isr68();
+extern void isr69();
+extern void isr70();
+extern void isr71();
+extern void isr72();
+extern void isr73();
+extern void isr74();
+extern void isr75();
+extern void isr76();
+extern void isr77();
+extern void isr78();
+extern void isr79();
+extern void isr80();
+extern void isr81();
+extern void isr82();
+extern void isr83();
+extern void isr84();
+extern void isr85();
+extern void isr86();
+extern void isr87();
 extern void isr128();
+extern void isr129();
+extern void isr130();
 extern void isr160();
 extern void isr161();
 extern void isr162();
@@ -142,6 +169,34 @@ void isr_install()
     idt_set_gate(31, (ptr_t)isr31, GDT_Code_Sel, 0x8E);
 
     idt_set_gate(0x80, (ptr_t)isr128, GDT_Code_Sel, 0x8E);
+    idt_set_gate(SMP_CALL_VECTOR, (ptr_t)isr129, GDT_Code_Sel, 0x8E);
+    idt_set_gate(TIMER_VECTOR, (ptr_t)isr130, GDT_Code_Sel, 0x8E);
+
+    /* I/O APIC inputs 0 .. IRQ_VECTORS-1 (see ioapic_route()) */
+    idt_set_gate(IRQ_VECTOR+0, (ptr_t)isr64, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+1, (ptr_t)isr65, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+2, (ptr_t)isr66, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+3, (ptr_t)isr67, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+4, (ptr_t)isr68, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+5, (ptr_t)isr69, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+6, (ptr_t)isr70, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+7, (ptr_t)isr71, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+8, (ptr_t)isr72, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+9, (ptr_t)isr73, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+10, (ptr_t)isr74, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+11, (ptr_t)isr75, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+12, (ptr_t)isr76, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+13, (ptr_t)isr77, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+14, (ptr_t)isr78, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+15, (ptr_t)isr79, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+16, (ptr_t)isr80, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+17, (ptr_t)isr81, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+18, (ptr_t)isr82, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+19, (ptr_t)isr83, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+20, (ptr_t)isr84, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+21, (ptr_t)isr85, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+22, (ptr_t)isr86, GDT_Code_Sel, 0x8E);
+    idt_set_gate(IRQ_VECTOR+23, (ptr_t)isr87, GDT_Code_Sel, 0x8E);
 
     idt_set_gate(0xA0, (ptr_t)isr160, GDT_Code_Sel, 0xA0);
     idt_set_gate(0xA1, (ptr_t)isr161, GDT_Code_Sel, 0xA1);
@@ -201,6 +256,19 @@ void int_handler(struct regs *r)
 {
     unsigned bak = cpu_online;
 
+    if (r->int_no == 0x80) {
+        /* arrival time first (bench_ipi() measures the latency up to here) */
+        my_cpu_info()->ipi_tsc = rdtsc();
+        my_cpu_info()->ipi_cnt++;
+    } else if (r->int_no == TIMER_VECTOR) {
+        /* the same for bench_timer() */
+        my_cpu_info()->timer_tsc = rdtsc();
+        my_cpu_info()->timer_cnt++;
+    }
+    if (r->int_no >= 32 && r->int_no != 0x80 && r->int_no != SMP_CALL_VECTOR) {
+        /* device and local (LVT) interrupts: should not hit a CPU in irq_isolate() */
+        my_cpu_info()->irq_cnt++;
+    }
     if (r->int_no < 32) {
         printf("|\n");
         printf("| CPU %u\n", my_cpu_info()->cpu_id);
@@ -238,7 +306,12 @@ void int_handler(struct regs *r)
             printf("| System halted.\n");
             while(1) {__asm__ volatile ("hlt"); };
         }
-    } else {
+    } else if (r->int_no != 0x80 && r->int_no != SMP_CALL_VECTOR && r->int_no != TIMER_VECTOR
+            && (r->int_no < IRQ_VECTOR || r->int_no >= IRQ_VECTOR+IRQ_VECTORS)) {
+        /* 
+         * unexpected vectors only: the kernel's own IPIs, timer and device interrupts come 
+         * at high rates (benchmarks measure their latency), they are counted above
+         */
         IFV printf("/----------------------------------------\n");
         IFV printf("| CPU %u\n", my_cpu_info()->cpu_id);
         IFV printf("| Interrupt: %u / 0x%x\n", r->int_no, r->int_no);
@@ -247,6 +320,12 @@ void int_handler(struct regs *r)
     switch (r->int_no) {
         case 0x3F : break;
         case 0x80 : break;
+        case SMP_CALL_VECTOR : 
+            smp_call_process();
+            break;
+        case TIMER_VECTOR : 
+            timer_interrupt();
+            break;
     }
     /*
      * EOI
@@ -76,9 +76,9 @@ Realm64:
     ; Realm32 is 0x140000 (0x40000 above 1MB).
     ; Attention: below 1MB is I/O space (no RAM)
 
-    extern stack            ; stack_t stack[MAX_CPUS] (in smp.c / smp.h)
+    extern stack_bsp        ; stack_t stack_bsp (in smp.c / smp.h)
     mov rdi, STACK_FRAMES*4096  ; stack size
-    add rdi, stack          ; add offset of first stack
+    add rdi, stack_bsp      ; add offset of the BSP's stack
     mov rsp, rdi            ; set Stack Pointer
 
 
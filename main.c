@@ -56,6 +56,7 @@
 #include "pci.h"
 #include "smm.h"
 #include "menu.h"
+#include "time.h"
 
 #define IFV   if (VERBOSE > 0 || VERBOSE_MAIN > 0)
 #define IFVV  if (VERBOSE > 1 || VERBOSE_MAIN > 1)
@@ -81,6 +82,7 @@ static char name_version[] = "BareMetalKernel" VERSION_BITS " " SVN_REV " OPT="
 void main_bsp(void)
 {
     char *vendor[] = {"Intel", "AMD", "unknown"};
+    uint64_t boot_tsc = rdtsc();            /* boot time: from here to the first global_barrier */
 
     *((uint32_t*)0xB8000) = 0x1F391F39;     /* "99" top left corner to say: "I've arrived in main()." */
     //status_putch(6, '/');
@@ -97,6 +99,7 @@ void main_bsp(void)
 
     mm_init();
     IFVV printf("my_cpu_info()->cpu_id: %u\n", my_cpu_info()->cpu_id);
+    smp_init_stacks();
 
 #if SCROLLBACK_BUF_SIZE
     init_video_scrollback();
@@ -147,7 +150,7 @@ void main_bsp(void)
     //print_smp_iboot32.o nfo();
 
     IFVV {
-        printf("offset of stack[0] : 0x%x ", &(stack[0]));
+        printf("offset of stack_bsp : 0x%x ", &stack_bsp);
         ptr_t sp;
 #       if __x86_64__
         __asm__ volatile("movq %%rsp, %%rax" : "=a"(sp) );
@@ -164,10 +167,17 @@ void main_bsp(void)
     
 
     cpu_online++;       // the BSP is there, too
+    wait_init();
+    barrier_topo_init();
+    sync_stats_name(&mutex_printf, "mutex_printf");
+    sync_stats_name(&pci_mutex, "pci_mutex");
+    sync_stats_name(&global_barrier, "global_barrier");
+    /* publish the number of participants, the APs wait for it in main_ap() */
+    __sync_synchronize();
     global_barrier.max = cpu_online;
-    /* wait until all others are in the following barrier */
-    while (global_barrier.cnt < (global_barrier.max-1)) {};
     barrier(&global_barrier);
+    printf("boot: %u CPUs at the global barrier after %u ms\n", (unsigned long)cpu_online,
+            (unsigned long)((rdtsc() - boot_tsc) / hw_info.tsc_per_usec / 1000));
 
     main();
 }
@@ -179,23 +189,26 @@ void main_bsp(void)
  */
 void main_ap(void)
 {
-    cpu_online++;
+    mm_init_ap();
+
     /*
-     * Signal, that the initialization of this CPU is done. 
-     * If I'm not here in time, apic_init() will trylock() my wakelock
-     * and I will block here.
+     * Join, unless apic_init() has given up on me already (see smp_close()):
+     * then my number may belong to another CPU and I halt here.
      */
-    mutex_lock(&(my_cpu_info()->wakelock)); 
-
-    mm_init_ap();
-    apic_init_ap(cpu_online);     // activate localAPIC on Application Processors
+    if (!__sync_bool_compare_and_swap(&(my_cpu_info()->join), SMP_JOIN_WAIT, SMP_JOIN_UP)) {
+        while (1) __asm__ volatile ("cli; hlt");
+    }
+    apic_init_ap(CPU_ID);         // activate localAPIC on Application Processors (records my APIC ID)
+    /* count me after that: apic_init() waits for all APs (they may start in parallel, see SMP_STARTUP) */
+    __sync_add_and_fetch(&cpu_online, 1);
     idt_install_ap();
 
-    smp_status(STATUS_RUNNING);
-
     //udelay(3000000*my_id);
     //printf("new[%d]: cpu_info = %x cpu_id = %x\n", cpu_online, my_cpu_info(), my_cpu_info()->cpu_id);
 
+    /* wait until the BSP knows the number of CPUs (global_barrier is initialized with MAX_CPU+1) */
+    while (global_barrier.max > MAX_CPU) {};
+    smp_status(STATUS_RUNNING);     /* with my final ID (smp_close() may have renumbered me) */
     barrier(&global_barrier);
     main();
 }
@@ -46,17 +46,20 @@
 #include "mm.h"
 #include "smp.h"
 #include "sync.h"
+#include "cpu.h"
 #include "multiboot_struct.h"
 #include "mm_struct.h"
 
 #define IFV   if (VERBOSE > 0 || VERBOSE_MM > 0)
 #define IFVV  if (VERBOSE > 1 || VERBOSE_MM > 1)
 
+extern volatile unsigned cpu_online;
+
 #if __x86_64__
-    /* initialized there in start64.asm */
-#   define MM64_MAP_TEMPORARY  0x5000
+#   define MM_TMP_WINDOW   0xFEA00000UL    /* in PDT.3 of start64.asm (below the APIC pages) */
 #else
-#   define MM32_MAP_TEMPORARY  0x2000
+#   define MM32_IDENTITY_PT    0x2000      /* page table for the first 4 MB (set up in mm_init()) */
+#   define MM_TMP_WINDOW   0xFE800000UL    /* pd1[1018] (below the APIC pages) */
 #endif
 
 /*
@@ -112,62 +115,186 @@ static inline void *page_to_adr(page_t page)
 /*  --------------------------------------------------------------------------- */
 
 
-unsigned long freemap[MAX_MEM / PAGE_SIZE / (sizeof(unsigned long)*8)];     // currently 2GB / 4kB / 8bits = 64kB
+/*
+ * Buddy allocator for the physical frames (4 kB) below MAX_MEM.
+ * Block i of order k (frames i*2^k .. (i+1)*2^k-1) is free, if bit i of the bitmap of order k
+ * is set; a freed block is merged with its free buddy. To find the first free block in O(log n),
+ * every bitmap has summary levels on top: bit i on level l+1 is set, if word i on level l is not 0.
+ * The bitmaps are in buddy_pool[] (initialized in mm_init()).
+ */
+#define BUDDY_FRAMES    (MAX_MEM / PAGE_SIZE)
+#define BUDDY_ORDERS    19              /* order 0 (4 kB) .. 18 (1 GB) */
+#define BUDDY_LEVELS    5               /* 2^19 bits in 32 bit words: 4 levels */
+#define BUDDY_BITS      (8 * sizeof(unsigned long))
+#define BUDDY_POOL      (2 * BUDDY_FRAMES / (BUDDY_BITS - 1) + BUDDY_ORDERS * BUDDY_LEVELS)
+#define BUDDY_NONE      (~(frame_t)0)
+
+static unsigned long buddy_pool[BUDDY_POOL];    /* about 130 kB */
+static struct {
+    unsigned levels;
+    unsigned long *bits[BUDDY_LEVELS];          /* level 0: one bit per block */
+} buddy[BUDDY_ORDERS] = {{ 0 }};
+static frame_t buddy_free_frames = 0;
+static mutex_t buddy_lock = MUTEX_INITIALIZER;
+
+static inline int buddy_test(unsigned k, frame_t i)
+{
+    return (buddy[k].bits[0][i / BUDDY_BITS] >> (i % BUDDY_BITS)) & 1;
+}
 
-static inline unsigned frame_to_freemap_index(frame_t frame)
+static void buddy_set(unsigned k, frame_t i)
 {
-    return (frame / (sizeof(unsigned long)*8));        // DIV 64
+    unsigned l;
+    unsigned long old;
+
+    for (l = 0; l < buddy[k].levels; l++) {
+        old = buddy[k].bits[l][i / BUDDY_BITS];
+        buddy[k].bits[l][i / BUDDY_BITS] = old | (1ul << (i % BUDDY_BITS));
+        if (old != 0) break;            /* the summary bit is set already */
+        i /= BUDDY_BITS;
+    }
 }
-static inline unsigned frame_to_freemap_bit(frame_t frame)
+
+static void buddy_clear(unsigned k, frame_t i)
 {
-    return (frame % (sizeof(unsigned long)*8));      // MOD 64
+    unsigned l;
+
+    for (l = 0; l < buddy[k].levels; l++) {
+        buddy[k].bits[l][i / BUDDY_BITS] &= ~(1ul << (i % BUDDY_BITS));
+        if (buddy[k].bits[l][i / BUDDY_BITS] != 0) break;     /* more free blocks in this word */
+        i /= BUDDY_BITS;
+    }
 }
-#define FRAME_TYPE_PT   1
-#define FRAME_TYPE_4k   2
-#if __x86_64__
-#define FRAME_TYPE_2M   3
-#define FRAME_TYPE_1G   4
-#else
-#define FRAME_TYPE_4M   5
-#endif
-frame_t get_free_frame(unsigned type)
+
+/* the first free block of order k (BUDDY_NONE: none), down from the top level (one word) */
+static frame_t buddy_find(unsigned k)
 {
-    static frame_t last_frame_pt = 0x400; // start at 4 MB (frame << PAGE_BITS = 0x400000)
-    static frame_t last_frame_4k = 0x800; // start at 8 MB (frame << PAGE_BITS = 0x800000)
-    /*
-     * 0x400 .. 0x800 : 1024 pagetables (32 bit: mapping 4 GB; 64 bit: mapping 2 GB)
-     */
+    unsigned l = buddy[k].levels - 1;
+    frame_t i = 0;
+
+    if (buddy[k].bits[l][0] == 0) return BUDDY_NONE;
+    for (;;) {
+        i = i * BUDDY_BITS + __builtin_ctzl(buddy[k].bits[l][i]);     /* bsf, no libgcc */
+        if (l == 0) return i;
+        l--;
+    }
+}
 
-    if (type == FRAME_TYPE_4k) {
-        IFVV printf("get_free_frame(4k): start at frame 0x%x ", last_frame_4k);
-        while (IS_BIT_CLEAR(freemap[frame_to_freemap_index(last_frame_4k)], frame_to_freemap_bit(last_frame_4k))) {
-            last_frame_4k++;
-            if (last_frame_4k >= (MAX_MEM / PAGE_SIZE)) {
-                printf("ERROR: out of memory!\n");
-                smp_status(STATUS_ERROR);
-                while (1) __asm__ volatile ("hlt");
+/* distribute buddy_pool[] to the orders and levels, all blocks used */
+static void buddy_layout(void)
+{
+    unsigned k, l;
+    unsigned long n, *p = buddy_pool;
+
+    for (k = 0; k < BUDDY_ORDERS; k++) {
+        n = BUDDY_FRAMES >> k;          /* bits on level 0 */
+        l = 0;
+        do {
+            buddy[k].bits[l++] = p;
+            n = (n + BUDDY_BITS - 1) / BUDDY_BITS;      /* words on this level = bits on the next one */
+            p += n;
+        } while (n > 1);
+        buddy[k].levels = l;
+    }
+    if (p > buddy_pool + BUDDY_POOL) {
+        printf("ERROR: buddy_pool too small (%u words needed)!\n", p - buddy_pool);
+        smp_status(STATUS_ERROR);
+        while (1) __asm__ volatile ("hlt");
+    }
+    memset(buddy_pool, 0, sizeof(buddy_pool));
+}
+
+/* 
+ * after mm_init() has set the free frames in the bitmap of order 0 (level 0 only): 
+ * merge all buddies bottom-up, then fill in the summary levels
+ */
+static void buddy_build(void)
+{
+    unsigned k, l;
+    frame_t i, n;
+
+    for (k = 1; k < BUDDY_ORDERS; k++) {
+        n = BUDDY_FRAMES >> k;
+        for (i = 0; i < n; i++) {
+            if (buddy_test(k-1, 2*i) && buddy_test(k-1, 2*i+1)) {
+                buddy[k-1].bits[0][(2*i) / BUDDY_BITS] &= ~(3ul << ((2*i) % BUDDY_BITS));
+                buddy[k].bits[0][i / BUDDY_BITS] |= 1ul << (i % BUDDY_BITS);
             }
         }
-        BIT_CLEAR(freemap[frame_to_freemap_index(last_frame_4k)], frame_to_freemap_bit(last_frame_4k));
-        IFVV printf("return frame 0x%x\n", last_frame_4k);
-        return last_frame_4k;
-    } else if (type == FRAME_TYPE_PT) {
-        IFVV printf("get_free_frame(pt): start at frame 0x%x ", last_frame_pt);
-        while (IS_BIT_CLEAR(freemap[frame_to_freemap_index(last_frame_pt)], frame_to_freemap_bit(last_frame_pt))) {
-            last_frame_pt++;
-            if (last_frame_pt >= (MAX_MEM / PAGE_SIZE)) {
-                printf("ERROR: out of memory!\n");
-                smp_status(STATUS_ERROR);
-                while (1) __asm__ volatile ("hlt");
+    }
+    for (k = 0; k < BUDDY_ORDERS; k++) {
+        n = BUDDY_FRAMES >> k;
+        for (l = 1; l < buddy[k].levels; l++) {
+            n = (n + BUDDY_BITS - 1) / BUDDY_BITS;      /* words on level l-1 */
+            for (i = 0; i < n; i++) {
+                if (buddy[k].bits[l-1][i]) buddy[k].bits[l][i / BUDDY_BITS] |= 1ul << (i % BUDDY_BITS);
             }
         }
-        BIT_CLEAR(freemap[frame_to_freemap_index(last_frame_pt)], frame_to_freemap_bit(last_frame_pt));
-        IFVV printf("return frame 0x%x\n", last_frame_pt);
-        return last_frame_pt;
     }
-    printf("ERROR: type %d not supported!\n", type);
-    smp_status(STATUS_ERROR);
-    while (1) __asm__ volatile ("hlt");
+}
+
+frame_t frame_alloc(unsigned order)
+{
+    unsigned k;
+    frame_t i = BUDDY_NONE;
+
+    if (order >= BUDDY_ORDERS) return 0;
+
+    mutex_lock(&buddy_lock);
+    for (k = order; k < BUDDY_ORDERS; k++) {
+        i = buddy_find(k);
+        if (i != BUDDY_NONE) break;
+    }
+    if (i == BUDDY_NONE) {
+        mutex_unlock(&buddy_lock);
+        return 0;
+    }
+    buddy_clear(k, i);
+    while (k > order) {
+        /* split: the upper half stays free */
+        k--;
+        i *= 2;
+        buddy_set(k, i + 1);
+    }
+    buddy_free_frames -= (frame_t)1 << order;
+    mutex_unlock(&buddy_lock);
+
+    IFVV printf("frame_alloc(%u): return frame 0x%x\n", order, i << order);
+    return i << order;
+}
+
+void frame_free(frame_t frame, unsigned order)
+{
+    frame_t i = frame >> order;
+
+    mutex_lock(&buddy_lock);
+    buddy_free_frames += (frame_t)1 << order;
+    while (order + 1 < BUDDY_ORDERS && buddy_test(order, i ^ 1)) {
+        /* merge with the free buddy */
+        buddy_clear(order, i ^ 1);
+        i >>= 1;
+        order++;
+    }
+    buddy_set(order, i);
+    mutex_unlock(&buddy_lock);
+}
+
+unsigned long mm_free_frames(void)
+{
+    return buddy_free_frames;
+}
+
+/* one frame (page table or 4 kB page), halts if there is none */
+static frame_t get_free_frame(void)
+{
+    frame_t frame = frame_alloc(0);
+
+    if (frame == 0) {
+        printf("ERROR: out of memory!\n");
+        smp_status(STATUS_ERROR);
+        while (1) __asm__ volatile ("hlt");
+    }
+    return frame;
 }
 
 /*  --------------------------------------------------------------------------- */
@@ -178,15 +305,27 @@ static pd1_entry_t *pd1;
 
 /*  --------------------------------------------------------------------------- */
 
+/*
+ * Every CPU has its own temporary page (slot) in a window at MM_TMP_WINDOW, far away from
+ * the kernel image and the heap. Its page table tmp_pt[] is in the kernel image (identity mapped)
+ * and is hooked into the page directory in mm_init(). Page walks under the read lock 
+ * (virt_to_phys) can run concurrently: only the owner CPU changes and uses its entry, 
+ * the local invlpg is sufficient. With more than MM_TMP_PAGES CPUs, a slot is shared 
+ * and readers take its tmp_lock[] for the walk; then the entry may have been changed by
+ * the other CPUs of the slot since my TLB loaded it, and every call needs the invlpg.
+ */
+#define MM_TMP_PAGES    256
+#define tmp_slot()      (CPU_ID % MM_TMP_PAGES)
+#if MAX_CPU > MM_TMP_PAGES
+static mutex_t tmp_lock[MM_TMP_PAGES];
+#endif
+static pt_entry_t tmp_pt[pt_num_entries] __attribute__ ((aligned (PAGE_SIZE)));    /* initialized in mm_init() */
+
 static void *map_temporary(frame_t frame) 
 {
-    const page_t tmp_page = 0x1FF;                              /* this page is mapped initially in 32 AND 64 bit mode */
-    void * const tmp_map = (void*)(tmp_page << PAGE_BITS);      /* just below 2 MB */
-#   if __x86_64__
-        static pt_entry_t * const  pt = (pt_entry_t*)MM64_MAP_TEMPORARY;    /* initialized there in start64.asm */
-#   else
-        static pt_entry_t * const  pt = (pt_entry_t*)MM32_MAP_TEMPORARY;    /* initialized in LABEL:385 [LABEL:155] */
-#   endif
+    pt_entry_t * const pt = tmp_pt;
+    const unsigned tmp_page = tmp_slot();
+    void * const tmp_map = (void*)(MM_TMP_WINDOW + ((ptr_t)tmp_page << PAGE_BITS));
 
     if (pt[tmp_page].page.frame != frame) {
         IFVV printf("map_temporary: frame 0x%x to adr 0x%x\n", frame, tmp_map);
@@ -200,6 +339,12 @@ static void *map_temporary(frame_t frame)
         __asm__ volatile ("mfence");
         __asm__ volatile ("invlpg %0" : : "m"(*(int*)tmp_map));
     }
+#   if MAX_CPU > MM_TMP_PAGES
+    else {
+        /* shared slot: my TLB may still hold the frame another CPU mapped before */
+        __asm__ volatile ("invlpg %0" : : "m"(*(int*)tmp_map));
+    }
+#   endif
     return tmp_map;
 }
 
@@ -217,13 +362,12 @@ static void *map_temporary(frame_t frame)
 #define MAP_PWT             8   // page-level write-through
 #define MAP_PCD            16   // page-level cache disable
 
+/*
+ * map frame to adr: a 4 kB page or, with MAP_HUGE_*, a huge page at the level above
+ * (PS bit set; frame and adr must be aligned to the huge page, the entry must be unused).
+ */
 static void map_frame_to_adr(frame_t frame, void *adr, unsigned flags)
 {
-    if (flags & MAP_HUGE) {
-        printf("ERROR (map_frame_to_adr): flags %d not supported, yet!\n", flags);
-        smp_status(STATUS_ERROR);
-        while (1) __asm__ volatile ("hlt");
-    }
     IFVV printf("map_frame_to_adr(frame=0x%x, adr=0x%x, flags=0x%x)\n", frame, adr, flags);
 
 #   if __x86_64__
@@ -233,7 +377,7 @@ static void map_frame_to_adr(frame_t frame, void *adr, unsigned flags)
     pd2_entry_t *pd2;
     if (pd1[ipd1].dir.p == 0) {
         /* we need a new pd2 */
-        frame_t new_frame = get_free_frame(FRAME_TYPE_PT);
+        frame_t new_frame = get_free_frame();
         IFVV printf("map: new pd2: 0x%x\n", new_frame);
         pd1[ipd1].dir.p = 1;
         pd1[ipd1].dir.rw = 1;
@@ -248,10 +392,22 @@ static void map_frame_to_adr(frame_t frame, void *adr, unsigned flags)
     unsigned ipd2 = pd2_index(adr);
     IFVV printf("map: pd2=0x%x ipd2=%u\n", pd2, ipd2);
 
+    if (flags & MAP_HUGE_1G) {
+        if (pd2[ipd2].dir.p) goto huge_used;
+        pd2[ipd2].page.frame1G = frame >> (2*INDEX_BITS);
+        pd2[ipd2].page.rw = 1;
+        pd2[ipd2].page.ps = 1;
+        if (flags & MAP_PWT) pd2[ipd2].page.pwt = 1;
+        if (flags & MAP_PCD) pd2[ipd2].page.pcd = 1;
+        pd2[ipd2].page.p = 1;
+        __asm__ volatile ("invlpg %0" : : "m"(*(int*)adr));
+        return;
+    }
+
     pd3_entry_t *pd3;
     if (pd2[ipd2].dir.p == 0) {
         /* we need a new pd3 */
-        frame_t new_frame = get_free_frame(FRAME_TYPE_PT);
+        frame_t new_frame = get_free_frame();
         IFVV printf("map: new pd3: 0x%x\n", new_frame);
         pd2[ipd2].dir.p = 1;
         pd2[ipd2].dir.rw = 1;
@@ -266,10 +422,22 @@ static void map_frame_to_adr(frame_t frame, void *adr, unsigned flags)
     unsigned ipd3 = pd3_index(adr);
     IFVV printf("map: pd3=0x%x ipd3=%u\n", pd3, ipd3);
 
+    if (flags & MAP_HUGE_2M) {
+        if (pd3[ipd3].dir.p) goto huge_used;
+        pd3[ipd3].page.frame2M = frame >> INDEX_BITS;
+        pd3[ipd3].page.rw = 1;
+        pd3[ipd3].page.ps = 1;
+        if (flags & MAP_PWT) pd3[ipd3].page.pwt = 1;
+        if (flags & MAP_PCD) pd3[ipd3].page.pcd = 1;
+        pd3[ipd3].page.p = 1;
+        __asm__ volatile ("invlpg %0" : : "m"(*(int*)adr));
+        return;
+    }
+
     pt_entry_t *pt;
     if (pd3[ipd3].dir.p == 0) {
         /* we nedd a new pt */
-        frame_t new_frame = get_free_frame(FRAME_TYPE_PT);
+        frame_t new_frame = get_free_frame();
         IFVV printf("map: new pt: 0x%x\n", new_frame);
         pd3[ipd3].dir.frame = new_frame;
         pd3[ipd3].dir.rw = 1;
@@ -301,10 +469,22 @@ static void map_frame_to_adr(frame_t frame, void *adr, unsigned flags)
 
     unsigned ipd1 = pd1_index(adr);
 
+    if (flags & MAP_HUGE_4M) {
+        if (pd1[ipd1].dir.p) goto huge_used;
+        pd1[ipd1].page.frame4M = frame >> INDEX_BITS;
+        pd1[ipd1].page.rw = 1;
+        pd1[ipd1].page.ps = 1;
+        if (flags & MAP_PWT) pd1[ipd1].page.pwt = 1;
+        if (flags & MAP_PCD) pd1[ipd1].page.pcd = 1;
+        pd1[ipd1].page.p = 1;
+        __asm__ volatile ("invlpg %0" : : "m"(*(int*)adr));
+        return;
+    }
+
     pt_entry_t *pt;
     if (pd1[ipd1].dir.p == 0) {
         /* we need a new pt */
-        frame_t new_frame = get_free_frame(FRAME_TYPE_PT);
+        frame_t new_frame = get_free_frame();
         IFVV printf("map_frame_to_adr: new pt: 0x%x\n", new_frame);
         pd1[ipd1].dir.frame = new_frame;
         pd1[ipd1].dir.rw = 1;
@@ -334,14 +514,24 @@ static void map_frame_to_adr(frame_t frame, void *adr, unsigned flags)
     }
 #   endif
     IFVV printf("map_frame_to_adr: done\n");
+    return;
+
+huge_used:
+    printf("ERROR (map_frame_to_adr): huge page at 0x%x already (partly) mapped!\n", adr);
+    smp_status(STATUS_ERROR);
+    while (1) __asm__ volatile ("hlt");
 }
 
 
-static void reconf_adr(void *adr, unsigned flags)
+/*
+ * set the cache mode of the page containing adr (4 kB or huge page)
+ * returns the number of bytes from adr to the end of that page (PAGE_SIZE if not mapped)
+ */
+static size_t reconf_adr(void *adr, unsigned flags)
 {
     if (flags & ~(MAP_PWT|MAP_PCD)) {
         printf("WARNING (reconf_adr): flags %d not supported, yet!\n", flags);
-        return;
+        return PAGE_SIZE;
     }
     IFV printf("reconf_adr(adr=0x%x, flags=0x%x)\n", adr, flags);
 
@@ -353,7 +543,7 @@ static void reconf_adr(void *adr, unsigned flags)
     if (pd1[ipd1].dir.p == 0) {
         /* not mapped. */
         printf("WARNING (reconf_adr): pd2 not mapped!\n");
-        return;
+        return PAGE_SIZE;
     } else {
         pd2 = (pd2_entry_t*)map_temporary(pd1[ipd1].dir.frame);
     }
@@ -365,7 +555,14 @@ static void reconf_adr(void *adr, unsigned flags)
     if (pd2[ipd2].dir.p == 0) {
         /* not mapped. */
         printf("WARNING (reconf_adr): pd3 not mapped!\n");
-        return;
+        return PAGE_SIZE;
+    } else if (pd2[ipd2].dir.ps) {
+        /* 1 GB huge page */
+        pd2[ipd2].page.pwt = (flags & MAP_PWT) ? 1 : 0;
+        pd2[ipd2].page.pcd = (flags & MAP_PCD) ? 1 : 0;
+        __sync_synchronize();
+        __asm__ volatile ("invlpg %0" : : "m"(*(int*)adr));
+        return (1ul << (PAGE_BITS+2*INDEX_BITS)) - offset1G(adr);
     } else {
         pd3 = (pd3_entry_t*)map_temporary(pd2[ipd2].dir.frame);
     }
@@ -377,7 +574,14 @@ static void reconf_adr(void *adr, unsigned flags)
     if (pd3[ipd3].dir.p == 0) {
         /* not mapped. */
         printf("WARNING (reconf_adr): pt not mapped!\n");
-        return;
+        return PAGE_SIZE;
+    } else if (pd3[ipd3].dir.ps) {
+        /* 2 MB huge page */
+        pd3[ipd3].page.pwt = (flags & MAP_PWT) ? 1 : 0;
+        pd3[ipd3].page.pcd = (flags & MAP_PCD) ? 1 : 0;
+        __sync_synchronize();
+        __asm__ volatile ("invlpg %0" : : "m"(*(int*)adr));
+        return (1ul << (PAGE_BITS+INDEX_BITS)) - offset2M(adr);
     } else {
         pt = (pt_entry_t*)map_temporary(pd3[ipd3].dir.frame);
     }
@@ -387,7 +591,7 @@ static void reconf_adr(void *adr, unsigned flags)
     if (pt[ipt].page.p == 0) {
         /* not mapped. */
         printf("WARNING (reconf_adr): page not mapped!\n");
-        return;
+        return PAGE_SIZE;
     } else {
         if (flags & MAP_PWT) {
             pt[ipt].page.pwt = 1;
@@ -414,7 +618,13 @@ static void reconf_adr(void *adr, unsigned flags)
     if (pd1[ipd1].dir.p == 0) {
         /* not mapped. */
         printf("WARNING (reconf_adr): pt not mapped!\n");
-        return;
+        return PAGE_SIZE;
+    } else if (pd1[ipd1].dir.ps) {
+        /* 4 MB huge page */
+        pd1[ipd1].page.pwt = (flags & MAP_PWT) ? 1 : 0;
+        pd1[ipd1].page.pcd = (flags & MAP_PCD) ? 1 : 0;
+        __asm__ volatile ("invlpg %0" : : "m"(*(int*)adr));
+        return (1ul << (PAGE_BITS+INDEX_BITS)) - offset4M(adr);
     } else {
         pt = (pt_entry_t*)map_temporary(pd1[ipd1].dir.frame);
     }
@@ -424,7 +634,7 @@ static void reconf_adr(void *adr, unsigned flags)
     if (pt[ipt].page.p == 0) {
         /* not mapped. */
         printf("WARNING (reconf_adr): page not mapped!\n");
-        return;
+        return PAGE_SIZE;
     } else {
         if (flags & MAP_PWT) {
             pt[ipt].page.pwt = 1;
@@ -443,6 +653,122 @@ static void reconf_adr(void *adr, unsigned flags)
     }
 #   endif
     IFVV printf("reconf_adr: done\n");
+    return PAGE_SIZE - offset(adr);
+}
+
+/* all entries of the (temporarily mapped) table are 0; from the top, where heap_free() has not been yet */
+static int table_empty(const void *table)
+{
+    const ptr_t *e = table;
+    int u;
+
+    for (u = PAGE_SIZE / sizeof(ptr_t) - 1; u >= 0; u--) {
+        if (e[u] != 0) return 0;
+    }
+    return 1;
+}
+
+/*
+ * unmap the page containing adr (4 kB or huge page), in two steps for heap_free():
+ * release = 0: clear the present bit (the entry keeps the frame), invalidate the local TLB entry;
+ * release = 1: (after the TLB shootdown) free the frame and clear the entry. Empty page tables
+ *              (and pd3 in 64 bit mode) are freed, too, so that a huge page fits there again.
+ * returns the number of bytes from adr to the end of that page (PAGE_SIZE if not mapped)
+ */
+static size_t unmap_adr(void *adr, unsigned release)
+{
+    size_t result;
+
+#   if __x86_64__
+    const frame_t f2 = pd1[pd1_index(adr)].dir.frame;
+    if (pd1[pd1_index(adr)].dir.p == 0) return PAGE_SIZE;
+
+    pd2_entry_t *pd2 = (pd2_entry_t*)map_temporary(f2);
+    if (pd2[pd2_index(adr)].dir.ps) {
+        /* 1 GB huge page */
+        if (release) {
+            frame_free((frame_t)pd2[pd2_index(adr)].page.frame1G << (2*INDEX_BITS), 2*INDEX_BITS);
+            pd2[pd2_index(adr)].u64 = 0;
+        } else {
+            pd2[pd2_index(adr)].page.p = 0;
+            __asm__ volatile ("invlpg %0" : : "m"(*(int*)adr));
+        }
+        return (1ul << (PAGE_BITS+2*INDEX_BITS)) - offset1G(adr);
+    }
+    if (pd2[pd2_index(adr)].dir.p == 0) return PAGE_SIZE;
+    const frame_t f3 = pd2[pd2_index(adr)].dir.frame;
+
+    pd3_entry_t *pd3 = (pd3_entry_t*)map_temporary(f3);
+    if (pd3[pd3_index(adr)].dir.ps) {
+        /* 2 MB huge page */
+        result = (1ul << (PAGE_BITS+INDEX_BITS)) - offset2M(adr);
+        if (!release) {
+            pd3[pd3_index(adr)].page.p = 0;
+            __asm__ volatile ("invlpg %0" : : "m"(*(int*)adr));
+            return result;
+        }
+        frame_free((frame_t)pd3[pd3_index(adr)].page.frame2M << INDEX_BITS, INDEX_BITS);
+        pd3[pd3_index(adr)].u64 = 0;
+    } else {
+        if (pd3[pd3_index(adr)].dir.p == 0) return PAGE_SIZE;
+        const frame_t fpt = pd3[pd3_index(adr)].dir.frame;
+
+        pt_entry_t *pt = (pt_entry_t*)map_temporary(fpt);
+        result = PAGE_SIZE - offset(adr);
+        if (pt[pt_index(adr)].page.frame == 0) return result;
+        if (!release) {
+            pt[pt_index(adr)].page.p = 0;
+            __asm__ volatile ("invlpg %0" : : "m"(*(int*)adr));
+            return result;
+        }
+        frame_free(pt[pt_index(adr)].page.frame, 0);
+        pt[pt_index(adr)].u64 = 0;
+        if (!table_empty(pt)) return result;
+
+        frame_free(fpt, 0);
+        pd3 = (pd3_entry_t*)map_temporary(f3);
+        pd3[pd3_index(adr)].u64 = 0;
+    }
+    /* the pd3 of the kernel (first GB) is never empty */
+    if (!table_empty(pd3)) return result;
+    frame_free(f3, 0);
+    pd2 = (pd2_entry_t*)map_temporary(f2);
+    pd2[pd2_index(adr)].u64 = 0;
+
+#   else
+    unsigned ipd1 = pd1_index(adr);
+
+    if (pd1[ipd1].dir.ps) {
+        /* 4 MB huge page */
+        if (release) {
+            frame_free((frame_t)pd1[ipd1].page.frame4M << INDEX_BITS, INDEX_BITS);
+            pd1[ipd1].u32 = 0;
+        } else {
+            pd1[ipd1].page.p = 0;
+            __asm__ volatile ("invlpg %0" : : "m"(*(int*)adr));
+        }
+        return (1ul << (PAGE_BITS+INDEX_BITS)) - offset4M(adr);
+    }
+    if (pd1[ipd1].dir.p == 0) return PAGE_SIZE;
+    const frame_t fpt = pd1[ipd1].dir.frame;
+
+    pt_entry_t *pt = (pt_entry_t*)map_temporary(fpt);
+    result = PAGE_SIZE - offset(adr);
+    if (pt[pt_index(adr)].page.frame == 0) return result;
+    if (!release) {
+        pt[pt_index(adr)].page.p = 0;
+        __asm__ volatile ("invlpg %0" : : "m"(*(int*)adr));
+        return result;
+    }
+    frame_free(pt[pt_index(adr)].page.frame, 0);
+    pt[pt_index(adr)].u32 = 0;
+    /* the page table of the kernel (first 4 MB) is never empty */
+    if (table_empty(pt)) {
+        frame_free(fpt, 0);
+        pd1[ipd1].u32 = 0;
+    }
+#   endif
+    return result;
 }
 
 
@@ -452,7 +778,10 @@ static void reconf_adr(void *adr, unsigned flags)
 
 /*  --------------------------------------------------------------------------- */
 
-mutex_t pt_mutex = MUTEX_INITIALIZER_LOCKED;
+rwlock_t pt_lock = RWLOCK_INITIALIZER;     /* write: changing page tables, read: page walks */
+#if __x86_64__
+static unsigned mm_page1G = 0;              /* 1 GB pages supported (CPUID.80000001h:EDX[bit 26]) */
+#endif
 
 /*
  * In 64 bit mode, paging is enabled by start64.__asm__ and the first 2 MB are identity-mapped.
@@ -460,8 +789,15 @@ mutex_t pt_mutex = MUTEX_INITIALIZER_LOCKED;
  */
 int mm_init()
 {
+    sync_stats_name(&pt_lock, "pt_lock");
+    rwlock_write_lock(&pt_lock);    // the mm is not usable until the end of mm_init()
     IFV printf("mm_init() \n");
 
+#   if MAX_CPU > MM_TMP_PAGES
+    unsigned slot;
+    for (slot = 0; slot < MM_TMP_PAGES; slot++) mutex_init(&tmp_lock[slot]);
+#   endif
+
 
 #   if __x86_64__
     /*
@@ -472,6 +808,16 @@ int mm_init()
     /* read address of page table PML4 (first level) from register cr3 */
     __asm__ volatile ("mov %%cr3, %%rax" : "=a"(pd1));
 
+    /* the window of map_temporary(): pd2 and pd3 (PDT.3) are in the first 2 MB (identity mapped) */
+    memset(tmp_pt, 0, sizeof(tmp_pt));
+    pd2_entry_t *tmp_pd2 = (pd2_entry_t*)(ptr_t)(pd1[pd1_index((void*)MM_TMP_WINDOW)].dir.frame << PAGE_BITS);
+    pd3_entry_t *tmp_pd3 = (pd3_entry_t*)(ptr_t)(tmp_pd2[pd2_index((void*)MM_TMP_WINDOW)].dir.frame << PAGE_BITS);
+    tmp_pd3[pd3_index((void*)MM_TMP_WINDOW)].dir.frame = (ptr_t)tmp_pt >> PAGE_BITS;
+    tmp_pd3[pd3_index((void*)MM_TMP_WINDOW)].dir.rw = 1;
+    tmp_pd3[pd3_index((void*)MM_TMP_WINDOW)].dir.p = 1;
+
+    if (hw_info.cpuid_high_max >= 0x80000001) mm_page1G = IS_BIT_SET(cpuid_edx(0x80000001), 26);
+
 #   else    /* 32 bit */
 
     /*
@@ -482,7 +828,13 @@ int mm_init()
     pd1 = (pd1_entry_t*)0x1000;
     memset(pd1, 0, PAGE_SIZE);
 
-    pt_entry_t* pt = (pt_entry_t*)MM32_MAP_TEMPORARY;       /* this frame/adr must be set in map_temporary(),LABEL:155 [LABEL:385] */
+    /* the window of map_temporary() */
+    memset(tmp_pt, 0, sizeof(tmp_pt));
+    pd1[pd1_index((void*)MM_TMP_WINDOW)].dir.frame = (ptr_t)tmp_pt >> PAGE_BITS;
+    pd1[pd1_index((void*)MM_TMP_WINDOW)].dir.rw = 1;
+    pd1[pd1_index((void*)MM_TMP_WINDOW)].dir.p = 1;
+
+    pt_entry_t* pt = (pt_entry_t*)MM32_IDENTITY_PT;
     memset(pt, 0, PAGE_SIZE);
     pd1[0].dir.frame = ((ptr_t)pt >> PAGE_BITS);
     pd1[0].dir.rw = 1;
@@ -513,6 +865,9 @@ int mm_init()
     pt[512].page.p = 1;
 
     __asm__ volatile ("mov %%eax, %%cr3" : : "a"(pd1));     /* set cr3 to page-directory */
+    __asm__ volatile ("mov %%cr4, %%eax "
+            "\n\t or $0x10, %%eax "
+            "\n\t mov %%eax, %%cr4" ::: "eax");          /*  4 MB pages with cr4[4] (PSE) */
     __asm__ volatile ("mov %%cr0, %%eax "
             "\n\t or $0x80000000, %%eax "
             "\n\t mov %%eax, %%cr0" ::: "eax");          /*  activate paging with cr0[31] */
@@ -544,11 +899,13 @@ int mm_init()
         IFVV printf("MM: pt = 0x%x\n", (ptr_t)pt);
 
     /*
-     * initialize freemap[]
+     * initialize the buddy allocator: free frames in order 0, then merge
      */
-    unsigned count = 0;
-    memset(freemap, 0, sizeof(freemap));
-    IFVV printf("freemap at 0x%x, sizeof(freemap): 0x%x\n", freemap, sizeof(freemap));
+    unsigned long count = 0;
+    unsigned long *freemap;
+    buddy_layout();
+    freemap = buddy[0].bits[0];
+    IFVV printf("buddy_pool at 0x%x, sizeof(buddy_pool): 0x%x\n", buddy_pool, sizeof(buddy_pool));
 
     multiboot_info_t *mbi = (multiboot_info_t*)(ptr_t)hw_info.mb_adr;
     if (IS_BIT_SET(mbi->flags, 0)) {
@@ -562,7 +919,7 @@ int mm_init()
         if (limit > (MAX_MEM >> PAGE_BITS)) limit = MAX_MEM >> PAGE_BITS;
         for (u = 0x400; u < limit; u++) {
             count++;
-            BIT_SET(freemap[frame_to_freemap_index(u)], frame_to_freemap_bit(u));
+            BIT_SET(freemap[u / BUDDY_BITS], u % BUDDY_BITS);
         }
     }
 
@@ -577,15 +934,17 @@ int mm_init()
                         p, (multiboot_uint32_t)(p->addr), (multiboot_uint32_t)(p->len), p->type, mem_type[p->type==1?0:1]);
                 for (u = (p->addr>>PAGE_BITS); u < ((p->addr + p->len) >> PAGE_BITS); u++) {
                     if (u >= 0x400 && u < (MAX_MEM >> PAGE_BITS)) {
-                        if (IS_BIT_CLEAR(freemap[frame_to_freemap_index(u)], frame_to_freemap_bit(u))) {
+                        if (IS_BIT_CLEAR(freemap[u / BUDDY_BITS], u % BUDDY_BITS)) {
                             count++;
-                            BIT_SET(freemap[frame_to_freemap_index(u)], frame_to_freemap_bit(u));
+                            BIT_SET(freemap[u / BUDDY_BITS], u % BUDDY_BITS);
                         }
                     }
                 }
             }
         }
     }
+    buddy_build();
+    buddy_free_frames = count;
     IFV printf("MM: registered %u=0x%x free pages (%u MB)\n", count, count, count>>8);
 
 
@@ -593,7 +952,7 @@ int mm_init()
     //int *p = (int*)0x00200000-4;    // 2 MB (- 4B) : access fine; 2 MB + 4B : page fault
     //*p = 0;
     
-    mutex_unlock(&pt_mutex);    // pt_mutex was initialized in locked state, from now on, the mm is usable
+    rwlock_write_unlock(&pt_lock);  // from now on, the mm is usable
     return 0;
 }
 
@@ -604,6 +963,9 @@ int mm_init_ap()
 #else
     /* initialize cr3 */
     __asm__ volatile ("mov %%eax, %%cr3" : : "a"(pd1));     /* set cr3 to page-directory */
+    __asm__ volatile ("mov %%cr4, %%eax "
+            "\n\t or $0x10, %%eax "
+            "\n\t mov %%eax, %%cr4" ::: "eax");          /*  4 MB pages with cr4[4] (PSE) */
     __asm__ volatile ("mov %%cr0, %%eax "
             "\n\t or $0x80000000, %%eax "
             "\n\t mov %%eax, %%cr0" ::: "eax");          /*  activate paging with cr0[31] := 1 */
@@ -611,7 +973,117 @@ int mm_init_ap()
     return 0;
 }
 
+/*
+ * virtual address space of the heap: above next_virt_page everything is free, below it the
+ * ranges in vm_free[] (sorted, coalesced). A range that does not fit into vm_free[] any more
+ * is lost (only address space, its frames are freed). All under the write lock of pt_lock.
+ */
+#define VM_FREE_RANGES  256
 static page_t next_virt_page = 0x400;
+static struct {
+    page_t first;
+    page_t nbr;
+} vm_free[VM_FREE_RANGES] = {{ 0, 0 }};
+static unsigned vm_free_cnt = 0;
+
+static void vm_insert(page_t first, page_t nbr)
+{
+    unsigned u, i;
+
+    if (nbr == 0) return;
+    for (i = 0; i < vm_free_cnt && vm_free[i].first < first; i++) ;
+
+    if (i > 0 && vm_free[i-1].first + vm_free[i-1].nbr == first) {
+        /* append to the range below */
+        i--;
+        vm_free[i].nbr += nbr;
+    } else if (i < vm_free_cnt && first + nbr == vm_free[i].first) {
+        /* prepend to the range above */
+        vm_free[i].first = first;
+        vm_free[i].nbr += nbr;
+    } else if (vm_free_cnt < VM_FREE_RANGES) {
+        for (u = vm_free_cnt; u > i; u--) vm_free[u] = vm_free[u-1];
+        vm_free[i].first = first;
+        vm_free[i].nbr = nbr;
+        vm_free_cnt++;
+    } else if (first + nbr != next_virt_page) {
+        IFV printf("vm_insert: vm_free[] full, lost 0x%x pages at page 0x%x\n", nbr, first);
+        return;
+    } else {
+        next_virt_page = first;
+        return;
+    }
+    if (i+1 < vm_free_cnt && vm_free[i].first + vm_free[i].nbr == vm_free[i+1].first) {
+        /* and the range above */
+        vm_free[i].nbr += vm_free[i+1].nbr;
+        for (u = i+1; u+1 < vm_free_cnt; u++) vm_free[u] = vm_free[u+1];
+        vm_free_cnt--;
+    }
+    if (i+1 == vm_free_cnt && vm_free[i].first + vm_free[i].nbr == next_virt_page) {
+        /* give back the top */
+        next_virt_page = vm_free[i].first;
+        vm_free_cnt--;
+    }
+}
+
+/* nbr pages, aligned to align pages (power of 2): first fit in vm_free[], or on top */
+static page_t vm_alloc(page_t nbr, page_t align)
+{
+    unsigned u;
+    page_t first, end;
+
+    for (u = 0; u < vm_free_cnt; u++) {
+        first = (vm_free[u].first + align - 1) & ~(align - 1);
+        end = vm_free[u].first + vm_free[u].nbr;
+        if (first + nbr > end) continue;
+        /* split: remove the range, insert the rest below and above */
+        page_t below = vm_free[u].first;
+        for ( ; u+1 < vm_free_cnt; u++) vm_free[u] = vm_free[u+1];
+        vm_free_cnt--;
+        vm_insert(below, first - below);
+        vm_insert(first + nbr, end - (first + nbr));
+        return first;
+    }
+    first = (next_virt_page + align - 1) & ~(align - 1);
+    vm_insert(next_virt_page, first - next_virt_page);      /* the gap */
+    next_virt_page = first + nbr;
+    return first;
+}
+
+/*
+ * Identity mapped memory (virtual == physical address) between 2 and 4 MB:
+ * above the kernel image and below the frames of the buddy allocator and the heap.
+ * For memory that is used with paging disabled, too (e.g. the stacks of the APs).
+ * Never freed.
+ */
+#define MM_IDENTITY_FIRST   0x200
+#define MM_IDENTITY_END     0x400
+static frame_t next_identity_frame = MM_IDENTITY_FIRST;
+
+void *identity_alloc(unsigned nbr_pages, unsigned align)
+{
+    frame_t frame;
+
+    rwlock_write_lock(&pt_lock);
+
+    frame = next_identity_frame;
+    if (align > 1) frame = (frame + align - 1) / align * align;
+    if (frame + nbr_pages > MM_IDENTITY_END) {
+        rwlock_write_unlock(&pt_lock);
+        return 0;
+    }
+    next_identity_frame = frame + nbr_pages;
+#   if __x86_64__
+    /* only the first 2 MB are mapped in start64.asm (in 32 bit mode, mm_init() maps the first 4 MB) */
+    frame_t u;
+    for (u = frame; u < frame + nbr_pages; u++) {
+        map_frame_to_adr(u, page_to_adr(u), 0);
+    }
+#   endif
+
+    rwlock_write_unlock(&pt_lock);
+    return (void*)(ptr_t)(frame << PAGE_BITS);
+}
 
 
 
@@ -619,34 +1091,148 @@ static page_t next_virt_page = 0x400;
 
 
 
+/*
+ * huge page sizes (as frame order), largest first, and the heap_alloc() flags that select them
+ */
+static const struct {
+    unsigned order;
+    unsigned map;
+    unsigned flags;
+} huge_sizes[] = {
+#if __x86_64__
+    { 2*INDEX_BITS,     MAP_HUGE_1G,    MM_HUGE_1G },
+    { INDEX_BITS,       MAP_HUGE_2M,    MM_HUGE_1G | MM_HUGE },
+#else
+    { INDEX_BITS,       MAP_HUGE_4M,    MM_HUGE_1G | MM_HUGE },
+#endif
+    { 0, 0, 0 }
+};
+
+static inline int huge_ok(unsigned h, unsigned flags)
+{
+    if (!(flags & huge_sizes[h].flags)) return 0;
+#   if __x86_64__
+    if (huge_sizes[h].map == MAP_HUGE_1G && !mm_page1G) return 0;
+#   endif
+    return 1;
+}
+
+int mm_huge_supported(unsigned flags)
+{
+    unsigned h;
+
+    for (h = 0; huge_sizes[h].order != 0; h++) {
+        if ((flags & huge_sizes[h].flags) && !huge_ok(h, flags)) return 0;
+    }
+    return 1;
+}
+
+/* the largest requested page size (in pages): heap_alloc() aligns the start to it */
+static frame_t heap_align(unsigned flags)
+{
+    unsigned h;
+
+    for (h = 0; huge_sizes[h].order != 0; h++) {
+        if (huge_ok(h, flags)) return (frame_t)1 << huge_sizes[h].order;
+    }
+    return 1;
+}
+
+/*
+ * With MM_HUGE/MM_HUGE_1G, each part of the range gets the largest allowed page size
+ * for which the buddy allocator has a free block; the rest gets 4 kB pages.
+ * Only the last page may extend beyond nbr_pages (a huge page is not split), so the
+ * request is rounded up to the page size that was actually obtained there.
+ */
 void *heap_alloc(unsigned nbr_pages, unsigned flags)
 {
-    unsigned i;
+    unsigned h;
     void *res;
-    frame_t frame;
+    frame_t frame, pages, align = heap_align(flags);
+    page_t page, end, reserved;
     unsigned map_flags = 0;
 
     if (flags & MM_WRITE_THROUGH) map_flags |= MAP_PWT;
     if (flags & MM_CACHE_DISABLE) map_flags |= MAP_PCD;
 
-    mutex_lock(&pt_mutex);
-
-    res = page_to_adr(next_virt_page);
-    for (i = 0; i < nbr_pages; i++) {
-        frame = get_free_frame(FRAME_TYPE_4k);
-        map_frame_to_adr(frame, page_to_adr(next_virt_page), map_flags);
-        next_virt_page++;
-        IFVV printf("next_virt_page=0x%x\n", next_virt_page);
+    rwlock_write_lock(&pt_lock);
+
+    /* address space for the largest page at the end, the unused rest is given back below */
+    reserved = (nbr_pages + align - 1) / align * align;
+    page = vm_alloc(reserved, align);
+    res = page_to_adr(page);
+    reserved += page;
+    end = page + nbr_pages;
+
+    while (page < end) {
+        for (h = 0; huge_sizes[h].order != 0; h++) {
+            pages = (frame_t)1 << huge_sizes[h].order;
+            if (!huge_ok(h, flags) || (page & (pages - 1))) continue;
+            frame = frame_alloc(huge_sizes[h].order);
+            if (frame != 0) break;
+            IFV printf("heap_alloc: no free block of %u frames, try smaller pages\n", pages);
+        }
+        if (huge_sizes[h].order != 0) {
+            map_frame_to_adr(frame, page_to_adr(page), map_flags | huge_sizes[h].map);
+            page += pages;
+        } else {
+            frame = get_free_frame();
+            map_frame_to_adr(frame, page_to_adr(page), map_flags);
+            page++;
+        }
     }
+    vm_insert(page, reserved - page);
+    IFVV printf("heap_alloc: 0x%x pages at 0x%x, next_virt_page=0x%x\n", page - ((ptr_t)res >> PAGE_BITS), res, next_virt_page);
 
-    mutex_unlock(&pt_mutex);
+    rwlock_write_unlock(&pt_lock);
     return res;
 }
 
+/*
+ * heap_free() : unmap nbr_pages at adr from heap_alloc() (and the rest of the last page,
+ * if it is a huge page), return the frames to the buddy allocator and the address range 
+ * to vm_free[]. The other CPUs' TLB entries are shot down before the frames are reused.
+ */
+void heap_free(void *adr, unsigned nbr_pages)
+{
+    void *p, *end;
+
+    adr = (void*)((ptr_t)adr & ~PAGE_MASK);          // round down to PAGE
+    end = adr + (size_t)nbr_pages * PAGE_SIZE;
+    if (adr < page_to_adr(0x400) || nbr_pages == 0) {
+        printf("WARNING (heap_free): 0x%x is not on the heap!\n", adr);
+        return;
+    }
+
+    rwlock_write_lock(&pt_lock);
+    for (p = adr; p < end; ) {
+        p += unmap_adr(p, 0);
+    }
+    end = p;                                        /* the end of the last (huge) page */
+    rwlock_write_unlock(&pt_lock);
+
+    /* not on the TLB of any CPU anymore: now the frames can be freed */
+    tlb_shootdown(adr, end - adr);
+
+    rwlock_write_lock(&pt_lock);
+    for (p = adr; p < end; ) {
+        p += unmap_adr(p, 1);
+    }
+    vm_insert((ptr_t)adr >> PAGE_BITS, (end - adr) >> PAGE_BITS);
+    IFVV printf("heap_free: 0x%x pages at 0x%x, next_virt_page=0x%x\n", (end - adr) >> PAGE_BITS, adr, next_virt_page);
+    rwlock_write_unlock(&pt_lock);
+}
+
 /**
  * head_reconfig()   : change flags of pages at adr:size
  * (used for benchmarks with different cache configuration)
  */
+typedef struct {
+    void *adr;
+    size_t size;
+} tlb_range_t;
+static void tlb_flush_call(void *arg);
+
 void heap_reconfig(void *adr, size_t size, unsigned flags)
 {
     unsigned map_flags = 0;
@@ -662,30 +1248,149 @@ void heap_reconfig(void *adr, size_t size, unsigned flags)
     size = (size+(PAGE_MASK)) & ~PAGE_MASK;
     IFV printf("adr=0x%x, size=%x\n", adr, size);
 
-    mutex_lock(&pt_mutex);
-    for (p = adr ; p < adr+size; p += PAGE_SIZE) {
-        reconf_adr(p, map_flags);
+    rwlock_write_lock(&pt_lock);
+    for (p = adr ; p < adr+size; ) {
+        p += reconf_adr(p, map_flags);      /* 4 kB or the rest of a huge page */
     }
-    mutex_unlock(&pt_mutex);
+    rwlock_write_unlock(&pt_lock);
+
+    /* reconf_adr() invalidated my own TLB entries, now the ones of the other CPUs (batched) */
+    tlb_range_t range = { adr, size };
+    smp_call_function(tlb_flush_call, &range, 1);
 }
 
-void tlb_shootdown(void *adr, size_t size)
+void tlb_flush(void *adr, size_t size)
 {
     void *p;
+    ptr_t cr3;
     adr = (void*)((ptr_t)adr & ~PAGE_MASK);          // round down to PAGE
     size = (size+(PAGE_MASK)) & ~PAGE_MASK;
 
+    if (size / PAGE_SIZE > TLB_FLUSH_MAX_PAGES) {
+        /* cheaper than invlpg on every page (there are no global pages) */
+        __asm__ volatile ("mov %%cr3, %0 \n\t mov %0, %%cr3" : "=r"(cr3) : : "memory");
+        return;
+    }
     for (p = adr ; p < adr+size; p += PAGE_SIZE) {
         __asm__ volatile ("invlpg %0" : : "m"(*(int*)p));
     }
+}
 
+static void tlb_flush_call(void *arg)
+{
+    tlb_range_t *range = arg;
+    tlb_flush(range->adr, range->size);
+}
+
+void tlb_shootdown_mask(const cpumask_t *mask, void *adr, size_t size)
+{
+    tlb_range_t range = { adr, size };
+    smp_call_function_mask(mask, tlb_flush_call, &range, 1);
+}
+
+void tlb_shootdown(void *adr, size_t size)
+{
+    cpumask_t mask;
+    cpumask_fill(&mask, cpu_online);
+    tlb_shootdown_mask(&mask, adr, size);
+}
+
+/*
+ * size of the page that maps adr (PAGE_SIZE or a huge page size), 0 if not mapped
+ */
+size_t mm_page_size(void *adr)
+{
+    size_t result = 0;
+
+    rwlock_read_lock(&pt_lock);
+#   if MAX_CPU > MM_TMP_PAGES
+    mutex_lock(&tmp_lock[tmp_slot()]);
+#   endif
+
+#   if __x86_64__
+    if (pd1[pd1_index(adr)].dir.p) {
+        pd2_entry_t *pd2 = (pd2_entry_t*)map_temporary(pd1[pd1_index(adr)].dir.frame);
+        if (pd2[pd2_index(adr)].dir.p) {
+            if (pd2[pd2_index(adr)].dir.ps) {
+                result = 1ul << (PAGE_BITS+2*INDEX_BITS);
+            } else {
+                pd3_entry_t *pd3 = (pd3_entry_t*)map_temporary(pd2[pd2_index(adr)].dir.frame);
+                if (pd3[pd3_index(adr)].dir.p) {
+                    if (pd3[pd3_index(adr)].dir.ps) {
+                        result = 1ul << (PAGE_BITS+INDEX_BITS);
+                    } else {
+                        pt_entry_t *pt = (pt_entry_t*)map_temporary(pd3[pd3_index(adr)].dir.frame);
+                        if (pt[pt_index(adr)].page.p) result = PAGE_SIZE;
+                    }
+                }
+            }
+        }
+    }
+#   else
+    if (pd1[pd1_index(adr)].dir.p) {
+        if (pd1[pd1_index(adr)].dir.ps) {
+            result = 1ul << (PAGE_BITS+INDEX_BITS);
+        } else {
+            pt_entry_t *pt = (pt_entry_t*)map_temporary(pd1[pd1_index(adr)].dir.frame);
+            if (pt[pt_index(adr)].page.p) result = PAGE_SIZE;
+        }
+    }
+#   endif
+
+#   if MAX_CPU > MM_TMP_PAGES
+    mutex_unlock(&tmp_lock[tmp_slot()]);
+#   endif
+    rwlock_read_unlock(&pt_lock);
+    return result;
+}
+
+/*
+ * mm_walk_cache() : cache mode of the page walks for adr:size
+ * MM_CACHE_DISABLE sets PCD in CR3 and in all directory entries on the way to the pages of the 
+ * range (not in the pages themselves), so that the page walker reads the tables from memory.
+ * This affects all walks through these tables (including the kernel's), flags = 0 restores.
+ * CR3 is reloaded on the calling CPU only: the other CPUs must not run meanwhile.
+ */
+#define CR3_PCD     (1u << 4)
+void mm_walk_cache(void *adr, size_t size, unsigned flags)
+{
+    const unsigned pcd = (flags & MM_CACHE_DISABLE) ? 1 : 0;
+    const ptr_t step = 1ul << (PAGE_BITS+INDEX_BITS);     /* one entry of the last directory */
+    ptr_t p, cr3;
+
+    rwlock_write_lock(&pt_lock);
+    for (p = (ptr_t)adr & ~(step-1); p < (ptr_t)adr + size; p += step) {
+#       if __x86_64__
+        if (!pd1[pd1_index((void*)p)].dir.p) continue;
+        pd1[pd1_index((void*)p)].dir.pcd = pcd;
+        pd2_entry_t *pd2 = (pd2_entry_t*)map_temporary(pd1[pd1_index((void*)p)].dir.frame);
+        if (!pd2[pd2_index((void*)p)].dir.p || pd2[pd2_index((void*)p)].dir.ps) continue;
+        pd2[pd2_index((void*)p)].dir.pcd = pcd;
+        pd3_entry_t *pd3 = (pd3_entry_t*)map_temporary(pd2[pd2_index((void*)p)].dir.frame);
+        if (!pd3[pd3_index((void*)p)].dir.p || pd3[pd3_index((void*)p)].dir.ps) continue;
+        pd3[pd3_index((void*)p)].dir.pcd = pcd;
+#       else
+        if (!pd1[pd1_index((void*)p)].dir.p || pd1[pd1_index((void*)p)].dir.ps) continue;
+        pd1[pd1_index((void*)p)].dir.pcd = pcd;
+#       endif
+    }
+
+    /* write back the cached tables, then the new CR3 flushes the TLB and the paging-structure caches */
+    __asm__ volatile ("wbinvd");
+    __asm__ volatile ("mov %%cr3, %0" : "=r"(cr3));
+    cr3 = pcd ? (cr3 | CR3_PCD) : (cr3 & ~(ptr_t)CR3_PCD);
+    __asm__ volatile ("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    rwlock_write_unlock(&pt_lock);
 }
 
 ptr_t virt_to_phys(void * adr)
 {
     ptr_t result = 0;
 
-    mutex_lock(&pt_mutex);
+    rwlock_read_lock(&pt_lock);
+#   if MAX_CPU > MM_TMP_PAGES
+    mutex_lock(&tmp_lock[tmp_slot()]);
+#   endif
 
 #   if __x86_64__
     if (pd1[pd1_index(adr)].dir.p) {
@@ -769,7 +1474,10 @@ ptr_t virt_to_phys(void * adr)
 #   endif
 
 finish:
-    mutex_unlock(&pt_mutex);
+#   if MAX_CPU > MM_TMP_PAGES
+    mutex_unlock(&tmp_lock[tmp_slot()]);
+#   endif
+    rwlock_read_unlock(&pt_lock);
     return result;
 }
 
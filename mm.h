@@ -45,6 +45,8 @@
 #ifndef MM_H
 #define MM_H
 
+#include "types.h"
+
 typedef     unsigned long    frame_t;    // the number of a physical page frame
 typedef     unsigned long    page_t;     // the number of a virtual page
 
@@ -54,11 +56,44 @@ int mm_init_ap();
 #define MM_WRITE_THROUGH    0x0010
 #define MM_CACHE_DISABLE    0x0020
 
+/*
+ * page size hint for heap_alloc(): the start is aligned to the huge page size.
+ * Where there is no free block of that size (or no 1 GB page support), smaller pages are used;
+ * nbr_pages (4 kB) is rounded up to the size of the last page used.
+ */
+#define MM_HUGE             0x0100      /* 2 MB pages (64 bit), 4 MB pages (32 bit) */
+#define MM_HUGE_1G          0x0200      /* 1 GB pages (64 bit), 4 MB pages (32 bit) */
+
+/* the CPU supports all page sizes that flags select (i.e. 1 GB pages for MM_HUGE_1G) */
+int mm_huge_supported(unsigned flags);
+
+/*
+ * physical frames (buddy allocator): frame_alloc() returns a free block of 2^order frames
+ * (aligned to its size, split from the smallest free block) or 0; frame_free() merges it with its buddies.
+ */
+frame_t frame_alloc(unsigned order);
+void frame_free(frame_t frame, unsigned order);
+unsigned long mm_free_frames(void);
+
 ptr_t virt_to_phys(void * adr);
+size_t mm_page_size(void *adr);
+void mm_walk_cache(void *adr, size_t size, unsigned flags);
 
 void *heap_alloc(unsigned nbr_pages, unsigned flags) __attribute__ ((malloc));
+void heap_free(void *adr, unsigned nbr_pages);
+void *identity_alloc(unsigned nbr_pages, unsigned align);
 void heap_reconfig(void *p, size_t size, unsigned flags);
+
+/*
+ * tlb_flush() invalidates the range in the local TLB; tlb_shootdown() on all CPUs and
+ * tlb_shootdown_mask() on the CPUs in mask. The other CPUs get the range with 
+ * smp_call_function_mask() (IPI, or polled while they wait) and acknowledge;
+ * these functions return when all CPUs have flushed.
+ * Ranges of more than TLB_FLUSH_MAX_PAGES pages flush the whole TLB (reload CR3).
+ */
+void tlb_flush(void *adr, size_t size);
 void tlb_shootdown(void *adr, size_t size);
+void tlb_shootdown_mask(const cpumask_t *mask, void *adr, size_t size);
 
 
 
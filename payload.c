@@ -68,7 +68,7 @@ static void init_buffers()
     if (CPU_ID == 0) {
 
         if (p_buffer == NULL) {
-            p_buffer = heap_alloc(buffer_size / PAGE_SIZE, BENCH_WORK_FLAGS);       // one page = 4kB
+            p_buffer = heap_alloc(buffer_size / PAGE_SIZE, BENCH_WORK_FLAGS | BENCH_PAGE_FLAGS);       // one page = 4kB
             /* no need for pre-faulting, because pages are present after heap_alloc()
              * (we don't have demand paging)
              * but initialize them */
@@ -77,7 +77,7 @@ static void init_buffers()
 
 
         if (p_contender == NULL) {
-            p_contender = heap_alloc(contender_size / PAGE_SIZE, BENCH_LOAD_FLAGS);       // one page = 4kB
+            p_contender = heap_alloc(contender_size / PAGE_SIZE, BENCH_LOAD_FLAGS | BENCH_PAGE_FLAGS);       // one page = 4kB
             //virt_to_phys(p_contender);
             //p_contender[0] = 42;
             //printf("[1] p_contender = 0x%x .. 0x%x\n", (ptr_t)p_contender, (ptr_t)p_contender+16*1024*1024);
@@ -117,15 +117,11 @@ void payload_benchmark()
     bench_worker_cut(p_buffer, p_contender, 16*KB);
     
     
+    /* heap_reconfig() shoots down the other CPUs' TLB entries (they wait in the barrier) */
     if (CPU_ID == 0) {
         heap_reconfig(p_buffer, buffer_size, 0);
         heap_reconfig(p_contender, contender_size, MM_CACHE_DISABLE);
-        barrier(&global_barrier);
         printf("========  Benchmark: WB / Load: CD ===================================\n");
-    } else {
-        barrier(&global_barrier);
-        tlb_shootdown(p_buffer, buffer_size);
-        tlb_shootdown(p_contender, contender_size);
     }
     barrier(&global_barrier);
     
@@ -137,12 +133,7 @@ void payload_benchmark()
     if (CPU_ID == 0) {
         heap_reconfig(p_buffer, buffer_size, 0);
         heap_reconfig(p_contender, contender_size, MM_WRITE_THROUGH);
-        barrier(&global_barrier);
         printf("========  Benchmark: WB / Load: WT ===================================\n");
-    } else {
-        barrier(&global_barrier);
-        tlb_shootdown(p_buffer, buffer_size);
-        tlb_shootdown(p_contender, contender_size);
     }
     barrier(&global_barrier);
     
@@ -170,6 +161,21 @@ void payload_benchmark_menu()
         {6, "bench_worker_cut(16 kB)"},
         {7, "bench_mem"},
         {8, "bench_rangestride"},
+        {9, "bench_lock"},
+        {10, "bench_lock_fairness"},
+        {11, "bench_barrier"},
+        {12, "bench_wait"},
+        {13, "bench_sync"},
+        {14, "bench_spsc"},
+        {15, "bench_mpmc"},
+        {16, "bench_task"},
+        {17, "bench_ipi"},
+        {18, "bench_shootdown"},
+        {19, "bench_c2c (latency)"},
+        {20, "bench_c2c (latency, bandwidth)"},
+        {21, "bench_timer"},
+        {22, "bench_isolation"},
+        {23, "bench_tlb"},
         {999, "return"},
         {0,0}
     };
@@ -254,6 +260,51 @@ void payload_benchmark_menu()
             case 8 : 
                 bench_rangestride(p_buffer);
                 break;
+            case 9 : 
+                bench_lock();
+                break;
+            case 10 : 
+                bench_lock_fairness();
+                break;
+            case 11 : 
+                bench_barrier();
+                break;
+            case 12 : 
+                bench_wait();
+                break;
+            case 13 : 
+                bench_sync();
+                break;
+            case 14 : 
+                bench_spsc();
+                break;
+            case 15 : 
+                bench_mpmc();
+                break;
+            case 16 : 
+                bench_task(p_buffer);
+                break;
+            case 17 : 
+                bench_ipi();
+                break;
+            case 18 : 
+                bench_shootdown(p_buffer);
+                break;
+            case 19 : 
+                bench_c2c(0);
+                break;
+            case 20 : 
+                bench_c2c(1);
+                break;
+            case 21 : 
+                bench_timer();
+                break;
+            case 22 : 
+                bench_isolation();
+                break;
+            case 23 : 
+                bench_tlb();
+                break;
         }
     } while (t != 999);
 
@@ -54,7 +54,7 @@
 #define CONFIG_ADR  0xCF8
 #define CONFIG_DATA 0xCFC
 
-mutex_t pci_mutex = MUTEX_INITIALIZER;
+klock_t pci_mutex = KLOCK_INITIALIZER;
 
 /*  
  *  see: http://wiki.osdev.org/PCI
@@ -66,11 +66,11 @@ uint16_t pci_config_read(uint16_t bus, uint16_t slot, uint16_t func, uint16_t of
     uint16_t value;
 
     adr = 0x80000000ul | ((uint32_t)bus << 16) | ((uint32_t)slot << 11) | (func << 8) | (offset & 0xfc);
-    mutex_lock(&pci_mutex);
+    klock_lock(&pci_mutex);
     outportl(CONFIG_ADR, adr);
     //udelay(100);
     value = (uint16_t)((inportl(CONFIG_DATA) >> ((offset & 2)*8)) & 0xFFFF);
-    mutex_unlock(&pci_mutex);
+    klock_unlock(&pci_mutex);
     return value;
 }
 
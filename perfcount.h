@@ -50,6 +50,8 @@
 #define PERFCOUNT_L1DATA    (uint64_t)0xFF000151ull
 #define PERFCOUNT_L2        (uint64_t)0xFF000224ull
 #define PERFCOUNT_L3        (uint64_t)0xFF000309ull
+#define PERFCOUNT_DTLB_MISS (uint64_t)0xFF000108ull  /* loads that miss all TLB levels (page walk) */
+#define PERFCOUNT_DTLB_WALK (uint64_t)0xFF001008ull  /* cycles of these page walks (Haswell..Skylake) */
 
 void perfcount_init(unsigned int counter, uint64_t config);
 uint64_t perfcount_raw(uint8_t event, uint8_t umask);
@@ -393,7 +393,7 @@ void itoa (char *buf, int base, long d)
  /* Format a string and print it on the screen, just like the libc
    function printf. */
 #ifndef EARLY
-mutex_t mutex_printf = MUTEX_INITIALIZER;
+klock_t mutex_printf = KLOCK_INITIALIZER;
 #endif
 
 /*
@@ -520,14 +520,14 @@ void printf (const char *format, ...)
   __builtin_va_start(ap, format);
 
 # ifndef EARLY
-  mutex_lock(&mutex_printf);
+  klock_lock(&mutex_printf);
 # endif
 
   vprintf(format, ap);
 
 
 # ifndef EARLY
-  mutex_unlock(&mutex_printf);
+  klock_unlock(&mutex_printf);
 # endif
   __builtin_va_end(ap);
 }
@@ -46,27 +46,141 @@
 #include "system.h"
 #include "apic.h"
 #include "cpu.h"
+#include "mm.h"
+#include "info_struct.h"
 
+#define IFV   if (VERBOSE > 0 || VERBOSE_APIC > 0)
 
-stack_t stack[MAX_CPU] __attribute__(( aligned(STACK_SIZE) ));
+
+stack_t stack_bsp __attribute__(( aligned(STACK_SIZE) ));
+stack_t *cpu_stack[MAX_CPU] = { &stack_bsp };
+
+static void smp_init_info(unsigned u)
+{
+    unsigned i;
+
+    cpu_stack[u]->info.cpu_id = u;
+    cpu_stack[u]->info.flags = 0;
+    cpu_stack[u]->info.join = SMP_JOIN_WAIT;
+    cpu_stack[u]->info.mcs_used = 0;
+    cpu_stack[u]->info.wait_adr = 0;
+    cpu_stack[u]->info.ipi_tsc = 0;
+    cpu_stack[u]->info.ipi_cnt = 0;
+    mpmc_init(&(cpu_stack[u]->info.call_queue), cpu_stack[u]->info.call_cell, SMP_CALL_SLOTS);
+    cpu_stack[u]->info.call_ipi = 0;
+    for (i = 0; i < SMP_CALL_ASYNC; i++) cpu_stack[u]->info.call_async[i].pending = 0;
+    cpu_stack[u]->info.timer_queue = 0;
+    cpu_stack[u]->info.timer_tsc = 0;
+    cpu_stack[u]->info.timer_cnt = 0;
+    cpu_stack[u]->info.irq_cnt = 0;
+    cpu_stack[u]->info.irq_mark = 0;
+}
+
+/*
+ * number of CPUs that get a stack (and are started):
+ * the ones found in the MADT, limited by the cmdline's maxcpu
+ */
+unsigned smp_cpu_cnt(void)
+{
+    unsigned cnt = hw_info.cpu_cnt;
+    if (cnt > hw_info.cmd_maxcpu) cnt = hw_info.cmd_maxcpu;
+    if (cnt > MAX_CPU) cnt = MAX_CPU;
+    if (cnt == 0) cnt = 1;
+    return cnt;
+}
 
 int smp_init(void)
 {
-    /* this is run before any other CPU (AP) is called */
+    /* this is run before any other CPU (AP) is called (and before mm_init()) */
     unsigned u;
-    for (u=0; u<MAX_CPU; u++) {
-        stack[u].info.cpu_id = u;
-        stack[u].info.flags = 0;
-        //if (u<4) printf("stack[%u].info.cpu_id at 0x%x value: %u\n", u, &(stack[u].info.cpu_id), stack[u].info.cpu_id);
-        mutex_init(&(stack[u].info.wakelock));  // state: unlocked
+    for (u=1; u<MAX_CPU; u++) {
+        cpu_stack[u] = 0;
+    }
+    cpu_stack[0] = &stack_bsp;
+    smp_init_info(0);
+    return 0;
+}
+
+int smp_init_stacks(void)
+{
+    /* this is run after mm_init() and before the APs are called */
+    unsigned u, cnt = smp_cpu_cnt();
+    stack_t *p;
+
+    if (cnt < 2) return 0;
+    p = (stack_t*)identity_alloc((cnt-1) * STACK_FRAMES, STACK_FRAMES);
+    if (p == 0) {
+        printf("ERROR: no memory for %u AP stacks, the APs are not started\n", cnt-1);
+        return -1;
+    }
+    IFV printf("SMP: %u AP stacks at 0x%x\n", cnt-1, (ptr_t)p);
+    for (u=1; u<cnt; u++) {
+        cpu_stack[u] = p++;
+        smp_init_info(u);
     }
     return 0;
 }
 
+extern volatile unsigned cpu_online;
+
+/*
+ * End of the AP startup (BSP, in apic_init()): the APs that have not joined yet never will
+ * (a late one halts in main_ap()), the others are waited for and renumbered densely:
+ * their stacks and hw_info.cpu[] entries move to 1 .. cpu_online, the rest behind them.
+ * The APs joined wait for global_barrier.max and do not use their ID before.
+ */
+void smp_close(unsigned cnt)
+{
+    unsigned src, dst, up = 0;
+    stack_t *s;
+    __typeof__(hw_info.cpu[0]) c;
+
+    for (src = 1; src < cnt; src++) {
+        if (cpu_stack[src] == 0) continue;
+        if (__sync_bool_compare_and_swap(&(cpu_stack[src]->info.join), SMP_JOIN_WAIT, SMP_JOIN_LATE)) {
+            printf("  #%u: CPU did not come up.\n", src);
+        } else if (cpu_stack[src]->info.join == SMP_JOIN_UP) {
+            up++;
+        }
+    }
+    /* an AP counts itself right after apic_init_ap() */
+    while (cpu_online < up) pause();
+
+    for (src = dst = 1; src < cnt; src++) {
+        if (cpu_stack[src] == 0 || cpu_stack[src]->info.join != SMP_JOIN_UP) continue;
+        if (src != dst) {
+            s = cpu_stack[dst];
+            cpu_stack[dst] = cpu_stack[src];
+            cpu_stack[src] = s;
+            cpu_stack[dst]->info.cpu_id = dst;
+            if (s != 0) s->info.cpu_id = src;
+            c = hw_info.cpu[dst];
+            hw_info.cpu[dst] = hw_info.cpu[src];
+            hw_info.cpu[src] = c;
+        }
+        dst++;
+    }
+    if (dst < cnt) IFV printf("SMP: %u APs renumbered to 1 .. %u\n", dst-1, dst-1);
+    for (src = 1; src < cnt; src++) {
+        status_putch(smp_status_col(src), (src < dst) ? STATUS_RUNNING : STATUS_NOTUP);
+    }
+}
+
+
+unsigned smp_status_cols(void)
+{
+    return (hw_info.cpu_cnt < STATUS_COLS) ? hw_info.cpu_cnt : STATUS_COLS;
+}
+
+unsigned smp_status_col(unsigned cpu_id)
+{
+    if (hw_info.cpu_cnt <= STATUS_COLS) return 6 + cpu_id;
+    return 6 + cpu_id * STATUS_COLS / hw_info.cpu_cnt;
+}
 
 void smp_status(char c)
 {
-    status_putch(6+my_cpu_info()->cpu_id, c);
+    status_putch(smp_status_col(my_cpu_info()->cpu_id), c);
 }
 
 void smp_halt(void)
@@ -86,16 +200,128 @@ void smp_halt(void)
 void smp_wakeup(unsigned cpu_id)
 {
     /* wait until CPU is in halted state (in case it is not there, yet) */
-    while (IS_MASK_CLEAR(stack[cpu_id].info.flags, SMP_FLAG_HALTED)) {
+    while (IS_MASK_CLEAR(cpu_stack[cpu_id]->info.flags, SMP_FLAG_HALTED)) {
         udelay(500);
     }
     /* remove flag */
-    MASK_CLEAR(stack[cpu_id].info.flags, SMP_FLAG_HALT);
+    MASK_CLEAR(cpu_stack[cpu_id]->info.flags, SMP_FLAG_HALT);
     udelay(5);
     /* send IPI until it is up */
-    while (IS_MASK_SET(stack[cpu_id].info.flags, SMP_FLAG_HALTED)) {
+    while (IS_MASK_SET(cpu_stack[cpu_id]->info.flags, SMP_FLAG_HALTED)) {
         send_ipi(cpu_id, 128);
         udelay(500);
     }
 }
 
+
+/*
+ * remote function calls
+ */
+
+/* run the calls queued for me (IPI handler; also called while waiting in smp_call_*()) */
+void smp_call_process(void)
+{
+    volatile cpu_info_t *info = my_cpu_info();
+    smp_call_t *call;
+    void *p;
+
+    /* re-arm the IPI before draining: a call queued after this point sends a new one */
+    __sync_lock_test_and_set(&info->call_ipi, 0);
+    while (mpmc_trydequeue((mpmc_t*)&info->call_queue, &p)) {
+        call = p;
+        call->func(call->arg);
+        __sync_sub_and_fetch(&call->pending, 1);
+    }
+}
+
+/* free descriptor of my own (pending set to n, so it is not taken twice) */
+static smp_call_t *smp_call_async_get(unsigned n)
+{
+    volatile cpu_info_t *info = my_cpu_info();
+    unsigned u, if_backup;
+
+    while (1) {
+        if_backup = cli();
+        for (u = 0; u < SMP_CALL_ASYNC; u++) {
+            if (info->call_async[u].pending == 0) {
+                info->call_async[u].pending = n;
+                if (if_backup) sti();
+                return (smp_call_t*)&info->call_async[u];
+            }
+        }
+        if (if_backup) sti();
+        smp_call_process();
+        pause();
+    }
+}
+
+static void smp_call_queue(unsigned cpu, smp_call_t *call)
+{
+    while (!mpmc_tryenqueue(&(cpu_stack[cpu]->info.call_queue), call)) {
+        /* queue full: make sure the target drains it (it might be waiting for me) */
+        if (__sync_lock_test_and_set(&(cpu_stack[cpu]->info.call_ipi), 1) == 0) {
+            send_ipi(cpu, SMP_CALL_VECTOR);
+        }
+        smp_call_process();
+        pause();
+    }
+}
+
+void smp_call_function_mask(const cpumask_t *mask, smp_call_func_t func, void *arg, int wait)
+{
+    smp_call_t sync_call, *call = 0;
+    cpumask_t targets;
+    unsigned myid = CPU_ID;
+    unsigned cpu, n, self;
+
+    cpumask_fill(&targets, cpu_online);
+    cpumask_and(&targets, &targets, mask);
+    self = cpumask_test(&targets, myid);
+    cpumask_unset(&targets, myid);
+    n = cpumask_weight(&targets);
+
+    if (n > 0) {
+        if (wait) {
+            call = &sync_call;
+            call->pending = n;
+        } else {
+            call = smp_call_async_get(n);
+        }
+        call->func = func;
+        call->arg = arg;
+        /* queue first, then one IPI per target that is not already signalled (batching) */
+        cpumask_for_each(cpu, &targets) {
+            smp_call_queue(cpu, call);
+        }
+        cpumask_for_each(cpu, &targets) {
+            if (__sync_lock_test_and_set(&(cpu_stack[cpu]->info.call_ipi), 1) == 0) {
+                send_ipi(cpu, SMP_CALL_VECTOR);
+            }
+        }
+    }
+
+    if (self) func(arg);
+
+    if (n > 0 && wait) {
+        while (call->pending) {
+            smp_call_process();
+            pause();
+        }
+    }
+}
+
+void smp_call_function_single(unsigned cpu, smp_call_func_t func, void *arg, int wait)
+{
+    cpumask_t mask;
+    cpumask_clear(&mask);
+    cpumask_set(&mask, cpu);
+    smp_call_function_mask(&mask, func, arg, wait);
+}
+
+void smp_call_function(smp_call_func_t func, void *arg, int wait)
+{
+    cpumask_t mask;
+    cpumask_fill(&mask, cpu_online);
+    cpumask_unset(&mask, CPU_ID);
+    smp_call_function_mask(&mask, func, arg, wait);
+}
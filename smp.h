@@ -49,15 +49,46 @@
 #include "config.h"
 #include "sync.h"
 
+/*
+ * remote function calls (see smp_call_function() below)
+ */
+#define SMP_CALL_VECTOR 0x81        /* IPI vector (isr.c) */
+#define SMP_CALL_SLOTS  16          /* cells of each CPU's call queue (power of 2) */
+#define SMP_CALL_ASYNC  4           /* descriptors per CPU for calls without waiting */
+typedef void (*smp_call_func_t)(void *arg);
+typedef struct {
+    smp_call_func_t func;
+    void *arg;
+    volatile unsigned pending;      /* number of CPUs that have not yet returned from func */
+} smp_call_t;
+
 /*
  * per-cpu info structure
  */
 #define SMP_FLAG_HALT   (1u <<0)
 #define SMP_FLAG_HALTED (1u <<1)
+/* join: the AP in main_ap() and the BSP in smp_close() race for it (see there) */
+#define SMP_JOIN_WAIT   0
+#define SMP_JOIN_UP     1
+#define SMP_JOIN_LATE   2
 typedef struct {
     unsigned cpu_id;   
     volatile unsigned flags;
-    mutex_t wakelock;
+    volatile unsigned join;                 /* SMP_JOIN_* */
+    volatile unsigned * volatile wait_adr;  /* word watched in wait_change(WAIT_HALT) */
+    volatile unsigned mcs_used;             /* bitmask of mcs_node[] in use */
+    mcs_node_t mcs_node[MCS_NODES];         /* queue nodes for mcslock_t */
+    volatile uint64_t ipi_tsc;              /* TSC at entry of the last IPI (vector 0x80, see isr.c) */
+    volatile unsigned long ipi_cnt;         /* number of IPIs (vector 0x80) received */
+    mpmc_t call_queue;                      /* smp_call_t* to be run on this CPU */
+    mpmc_cell_t call_cell[SMP_CALL_SLOTS];
+    volatile unsigned call_ipi;             /* 1: IPI sent, handler has not yet started draining */
+    smp_call_t call_async[SMP_CALL_ASYNC];  /* my descriptors for calls with wait == 0 */
+    ktimer_t * volatile timer_queue;        /* my timers, sorted by deadline (see time.h) */
+    volatile uint64_t timer_tsc;            /* TSC at entry of the last timer interrupt */
+    volatile unsigned long timer_cnt;       /* number of timer interrupts */
+    volatile unsigned long irq_cnt;         /* number of interrupts, except the IPIs 0x80 and SMP_CALL_VECTOR */
+    unsigned long irq_mark;                 /* irq_cnt at irq_isolate() (see apic.h) */
 } cpu_info_t;
 
 
@@ -69,9 +100,22 @@ typedef union {
     cpu_info_t info;
 } stack_t; // __attribute__((packed));
 
-extern stack_t stack[MAX_CPU];
+/*
+ * The BSP's stack is part of the kernel image (set up in start32.asm/jump64.asm), 
+ * the APs' stacks are allocated in smp_init_stacks() for the CPUs found in the MADT
+ * (identity mapped, because the APs use them before paging is enabled).
+ * cpu_stack[id] is NULL for CPUs that are not started.
+ * After smp_close(), the IDs of the running CPUs are dense: 0 .. cpu_online-1.
+ * Everything that walks the CPUs relies on that: the smp_wakeup() loops, collective_only(),
+ * cpumask_fill(cpu_online) and the ranks of barrier_tree()/barrier_topo().
+ */
+extern stack_t stack_bsp;
+extern stack_t *cpu_stack[MAX_CPU];
 
 int smp_init(void);
+int smp_init_stacks(void);
+unsigned smp_cpu_cnt(void);
+void smp_close(unsigned cnt);
 
 static inline volatile cpu_info_t * my_cpu_info()
 {
@@ -96,10 +140,41 @@ static inline volatile cpu_info_t * my_cpu_info()
 #define STATUS_STOP     '_'
 #define STATUS_NOTUP    '|'
 
+/*
+ * status line: one column per CPU (from column 6); with more than STATUS_COLS CPUs,
+ * neighbouring CPUs share a column (showing the last status written)
+ */
+#define STATUS_COLS     32
+unsigned smp_status_col(unsigned cpu_id);
+unsigned smp_status_cols(void);
 void smp_status(char c);
 
 void smp_halt(void);
 void smp_wakeup(unsigned cpu_id);
 
+/*
+ * Run func(arg) on one CPU, on the CPUs of a mask or on all other CPUs.
+ * The calls are queued per target CPU and executed by the IPI handler (with interrupts 
+ * disabled); one IPI drains all calls queued in the meantime. A target with interrupts
+ * disabled runs its calls when it enables them or calls smp_call_process().
+ * The caller runs its own share (if in mask) directly.
+ * func must be short and must not wait for locks (it may run inside a wait loop, see smp_call_poll()).
+ * wait: 1 - return after all targets have returned from func
+ *       0 - return after queueing (func and arg must stay valid)
+ */
+void smp_call_function_single(unsigned cpu, smp_call_func_t func, void *arg, int wait);
+void smp_call_function_mask(const cpumask_t *mask, smp_call_func_t func, void *arg, int wait);
+void smp_call_function(smp_call_func_t func, void *arg, int wait);
+void smp_call_process(void);
+
+/* 
+ * run queued calls without waiting for the IPI (interrupts disabled):
+ * wait_change() polls here, so CPUs waiting in barriers, flags and locks take part
+ */
+static inline void smp_call_poll(void)
+{
+    if (my_cpu_info()->call_ipi) smp_call_process();
+}
+
 #endif // SMP_H
 
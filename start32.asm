@@ -53,9 +53,9 @@ global start
 start:
     ;mov esp, _sys_stack     ; This points the stack to our new stack area
 
-    extern stack            ; stack_t stack[MAX_CPUS] (in smp.c / smp.h)
+    extern stack_bsp        ; stack_t stack_bsp (in smp.c / smp.h)
     mov edi, STACK_FRAMES*4096  ; stack size
-    add edi, stack          ; add offset of first stack
+    add edi, stack_bsp      ; add offset of the BSP's stack
     mov esp, edi            ; set Stack Pointer
 
     jmp stublet
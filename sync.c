@@ -44,6 +44,9 @@
 
 #include "sync.h"
 #include "smp.h"
+#include "cpu.h"
+#include "apic.h"
+#include "info_struct.h"
 #include "config.h"
 
 #define IFV   if (VERBOSE > 0 || VERBOSE_SYNC > 0)
@@ -79,6 +82,252 @@ uint32_t __sync_bool_compare_and_swap_4(volatile uint32_t *pointer, uint32_t old
 
 extern volatile unsigned cpu_online;
 
+/*
+ * Wait policies (see sync.h)
+ */
+wait_policy_t wait_policy[WAIT_FOR_CNT] = { WAIT_BARRIER, WAIT_FLAG, WAIT_MUTEX };
+char *wait_policy_name[WAIT_CNT] = {"spin", "pause", "backoff", "mwait", "halt"};
+static unsigned wait_has_mwait = 0;
+static unsigned wait_mwait_ext = 0;         /* 1: MWAIT wakes up on masked interrupts */
+static volatile unsigned wait_halted = 0;   /* number of CPUs in hlt in wait_change() */
+
+void wait_init(void)
+{
+    /* CPUID.1:ECX[3]: MONITOR/MWAIT */
+    wait_has_mwait = IS_BIT_SET(cpuid_ecx(1), 3);
+    /* CPUID.5:ECX[1]: interrupts as break-event for MWAIT, even when disabled (smp_call_poll()) */
+    if (wait_has_mwait && hw_info.cpuid_max >= 5) wait_mwait_ext = IS_BIT_SET(cpuid_ecx(5), 1);
+    IFV printf("wait_init: MONITOR/MWAIT %s\n", wait_has_mwait ? "supported" : "not supported");
+}
+
+void wait_change(volatile unsigned *adr, unsigned old, wait_policy_t policy)
+{
+    unsigned u, delay, if_backup;
+    volatile cpu_info_t *my_info;
+
+    if (policy == WAIT_MWAIT && !wait_has_mwait) policy = WAIT_PAUSE;
+
+    switch (policy) {
+        case WAIT_SPIN :
+            while (*adr == old) smp_call_poll();
+            break;
+        case WAIT_BACKOFF :
+            delay = 1;
+            while (*adr == old) {
+                smp_call_poll();
+                for (u = 0; u < delay; u++) pause();
+                if (delay < WAIT_BACKOFF_MAX) delay <<= 1;
+            }
+            break;
+        case WAIT_MWAIT :
+            while (*adr == old) {
+                smp_call_poll();
+                monitor(adr);
+                if (*adr != old) break;
+                mwait(wait_mwait_ext);
+            }
+            break;
+        case WAIT_HALT :
+            for (u = 0; u < WAIT_HALT_SPIN; u++) {
+                if (*adr != old) return;
+                smp_call_poll();
+                pause();
+            }
+            /* publish what I am waiting for, then re-check with interrupts disabled:
+             * the waker writes *adr before it reads wait_halted (see wait_wake()) */
+            my_info = my_cpu_info();
+            if_backup = cli();
+            my_info->wait_adr = adr;
+            __sync_add_and_fetch(&wait_halted, 1);
+            while (*adr == old) {
+                /* sti delays interrupts by one instruction: no wake-up IPI is lost before hlt */
+                __asm__ volatile ("sti; hlt; cli" ::: "memory");
+            }
+            my_info->wait_adr = 0;
+            __sync_sub_and_fetch(&wait_halted, 1);
+            if (if_backup) sti();
+            break;
+        default :
+            while (*adr == old) {
+                smp_call_poll();
+                pause();
+            }
+    }
+}
+
+void wait_wake(volatile unsigned *adr)
+{
+    unsigned u;
+
+    __sync_synchronize();
+    if (wait_halted == 0) return;
+    for (u = 0; u < cpu_online; u++) {
+        if (cpu_stack[u]->info.wait_adr == adr) send_ipi(u, 0x80);
+    }
+}
+
+/*
+ * Lock and barrier statistics (see sync.h)
+ */
+#if SYNC_STATS
+typedef struct {
+    const volatile void * volatile adr;     /* lock or barrier (NULL: entry unused) */
+    const char *name;
+    unsigned barrier;                       /* 1: barrier_t, 0: lock */
+    /* locks */
+    unsigned long acquisitions;
+    unsigned long contended;
+    uint64_t spin;
+    uint64_t spin_max;
+    uint64_t hold_max;
+    uint64_t hold_start;
+    /* barriers */
+    unsigned long episodes;
+    uint64_t skew;
+    uint64_t skew_max;
+    volatile unsigned epoch;                /* episode of the barrier (parity selects first/last[]) */
+    volatile uint64_t first[2];             /* earliest and latest arrival (0: none yet) */
+    volatile uint64_t last[2];
+} sync_stats_t;
+static sync_stats_t sync_stats[SYNC_STATS_MAX] = {{0}};
+
+/* find (or add) the entry of adr (NULL: table full) */
+static sync_stats_t *stats_get(const volatile void *adr)
+{
+    unsigned u;
+
+    for (u = 0; u < SYNC_STATS_MAX; u++) {
+        if (sync_stats[u].adr == adr) return &sync_stats[u];
+        if (sync_stats[u].adr == NULL) {
+            if (__sync_bool_compare_and_swap(&sync_stats[u].adr, NULL, adr)) return &sync_stats[u];
+            if (sync_stats[u].adr == adr) return &sync_stats[u];
+        }
+    }
+    return NULL;
+}
+
+void sync_stats_name(const volatile void *adr, const char *name)
+{
+    sync_stats_t *s = stats_get(adr);
+    if (s) s->name = name;
+}
+
+/* lock acquired after spin cycles (for shared read locks, the update is atomic and without hold time) */
+static void stats_locked(const volatile void *adr, uint64_t spin, unsigned contended, unsigned shared)
+{
+    sync_stats_t *s = stats_get(adr);
+
+    if (s == NULL) return;
+    if (shared) {
+        __sync_add_and_fetch(&s->acquisitions, 1);
+        if (contended) __sync_add_and_fetch(&s->contended, 1);
+    } else {
+        s->acquisitions++;
+        if (contended) s->contended++;
+        s->spin += spin;
+        s->hold_start = rdtsc();
+    }
+    if (spin > s->spin_max) s->spin_max = spin;
+}
+
+static void stats_unlock(const volatile void *adr)
+{
+    sync_stats_t *s = stats_get(adr);
+    uint64_t hold;
+
+    if (s == NULL) return;
+    hold = rdtsc() - s->hold_start;
+    if (hold > s->hold_max) s->hold_max = hold;
+}
+
+/* 
+ * CPU 0 (always a participant) evaluates the arrival times after the episode;
+ * the others may already arrive at the next episode, therefore two sets of arrival times.
+ * The set is selected by the episode of the barrier, which all participants read on arrival
+ * (it changes only after all of them have arrived: the first one leaving counts it up).
+ */
+static unsigned stats_barrier_arrive(sync_stats_t *s)
+{
+    unsigned e;
+    uint64_t t, old;
+
+    if (s == NULL) return 0;
+    s->barrier = 1;
+    e = s->epoch;
+    t = rdtsc();
+    do {
+        old = s->first[e & 1];
+    } while ((old == 0 || t < old) && !__sync_bool_compare_and_swap(&s->first[e & 1], old, t));
+    do {
+        old = s->last[e & 1];
+    } while (t > old && !__sync_bool_compare_and_swap(&s->last[e & 1], old, t));
+    return e;
+}
+
+static void stats_barrier_leave(sync_stats_t *s, unsigned e, unsigned myid)
+{
+    uint64_t skew;
+
+    if (s == NULL) return;
+    __sync_bool_compare_and_swap(&s->epoch, e, e + 1);
+    if (myid != 0) return;
+    skew = s->last[e & 1] - s->first[e & 1];
+    /* free for episode e+2 (that needs CPU 0 to arrive again) */
+    s->first[e & 1] = 0;
+    s->last[e & 1] = 0;
+    s->episodes++;
+    s->skew += skew;
+    if (skew > s->skew_max) s->skew_max = skew;
+}
+
+/* a barrier with (possibly) new participants: forget an unfinished episode */
+static void stats_barrier_init(const barrier_t *b)
+{
+    sync_stats_t *s = stats_get(b);
+
+    if (s == NULL) return;
+    s->epoch = 0;
+    s->first[0] = s->first[1] = 0;
+    s->last[0] = s->last[1] = 0;
+}
+
+#   define STATS_BEGIN                  uint64_t stats_tsc = rdtsc(); unsigned stats_contended = 0
+#   define STATS_CONTENDED              stats_contended = 1
+#   define STATS_LOCKED(adr, shared)    stats_locked((adr), rdtsc() - stats_tsc, stats_contended, (shared))
+#   define STATS_UNLOCK(adr)            stats_unlock(adr)
+#else
+#   define STATS_BEGIN                  do {} while (0)
+#   define STATS_CONTENDED              do {} while (0)
+#   define STATS_LOCKED(adr, shared)    do {} while (0)
+#   define STATS_UNLOCK(adr)            do {} while (0)
+#endif
+
+void sync_stats_print(void)
+{
+#if SYNC_STATS
+    unsigned u;
+    sync_stats_t *s;
+
+    printf("lock                acquired contended   avg spin   max spin   max hold\n");
+    for (u = 0; u < SYNC_STATS_MAX; u++) {
+        s = &sync_stats[u];
+        if (s->adr == NULL || s->barrier || s->acquisitions == 0) continue;
+        if (s->name) printf("%-18s", s->name); else printf("0x%-16x", (ptr_t)s->adr);
+        printf(" %8u %9u %10u %10u %10u\n", s->acquisitions, s->contended,
+                (unsigned long)(s->spin / s->acquisitions), (unsigned long)s->spin_max, (unsigned long)s->hold_max);
+    }
+    printf("barrier             episodes   avg skew   max skew\n");
+    for (u = 0; u < SYNC_STATS_MAX; u++) {
+        s = &sync_stats[u];
+        if (s->adr == NULL || !s->barrier || s->episodes == 0) continue;
+        if (s->name) printf("%-18s", s->name); else printf("0x%-16x", (ptr_t)s->adr);
+        printf(" %8u %10u %10u\n", s->episodes, (unsigned long)(s->skew / s->episodes), (unsigned long)s->skew_max);
+    }
+#else
+    printf("sync statistics are not enabled (SYNC_STATS in config.h)\n");
+#endif
+}
+
 void mutex_init(mutex_t *m)
 {
     *m = MUTEX_INITIALIZER;
@@ -86,23 +335,256 @@ void mutex_init(mutex_t *m)
 /* 1: free, 0: locked */
 void mutex_lock(mutex_t *m)
 {
+    STATS_BEGIN;
     smp_status(STATUS_MUTEX);
-    while (!__sync_bool_compare_and_swap(m, 1, 0)) {};
+    while (!__sync_bool_compare_and_swap(m, 1, 0)) {
+        STATS_CONTENDED;
+        wait_change((volatile unsigned*)m, 0, wait_policy[WAIT_FOR_MUTEX]);
+    }
     // CAS: (type *ptr, type oldval, type newval)
     // bool version of CAS: return true if test was successful and values were swapped
     // repeat while test was not successful
     smp_status(STATUS_RUNNING);
+    STATS_LOCKED(m, 0);
 }
 
 int mutex_trylock(mutex_t *m)
 {
     /* 0/false: try was unsuccessful, 1/true: lock obtained successfully */
-    return (__sync_bool_compare_and_swap(m, 1, 0));
+    STATS_BEGIN;
+    if (__sync_bool_compare_and_swap(m, 1, 0)) {
+        STATS_LOCKED(m, 0);
+        return 1;
+    }
+    return 0;
 }
 
 void mutex_unlock(mutex_t *m)
 {
+    STATS_UNLOCK(m);
     *m = 1;
+    wait_wake((volatile unsigned*)m);
+}
+
+
+/*
+ * MCS queue lock
+ * The queue nodes come from the per-CPU pool in cpu_info_t. 
+ * Allocation is done with CAS, because an interrupt handler might take a lock, too.
+ */
+static mcs_node_t *mcs_node_get(void)
+{
+    volatile cpu_info_t *info = my_cpu_info();
+    unsigned used, u;
+
+    while (1) {
+        used = info->mcs_used;
+        for (u=0; u<MCS_NODES; u++) {
+            if (IS_MASK_CLEAR(used, 1u << u)) break;
+        }
+        if (u == MCS_NODES) {
+            /* nesting too deep (can't use printf here, it might use an MCS lock itself) */
+            smp_status(STATUS_ERROR);
+            while (1) __asm__ volatile ("hlt");
+        }
+        if (__sync_bool_compare_and_swap(&info->mcs_used, used, used | (1u << u))) {
+            return (mcs_node_t*)&info->mcs_node[u];
+        }
+    }
+}
+
+static void mcs_node_put(mcs_node_t *node)
+{
+    volatile cpu_info_t *info = my_cpu_info();
+    unsigned u = node - (mcs_node_t*)&info->mcs_node[0];
+    __sync_fetch_and_and(&info->mcs_used, ~(1u << u));
+}
+
+void mcslock_init(mcslock_t *l)
+{
+    *l = (mcslock_t)MCSLOCK_INITIALIZER;
+}
+
+void mcslock_lock(mcslock_t *l)
+{
+    mcs_node_t *me = mcs_node_get();
+    mcs_node_t *pred;
+    STATS_BEGIN;
+
+    me->next = 0;
+    me->locked = 1;
+
+    smp_status(STATUS_MUTEX);
+    /* atomically append my node to the queue (xchg is a full barrier) */
+    pred = __sync_lock_test_and_set(&l->tail, me);
+    if (pred != 0) {
+        /* lock is taken: link behind predecessor and spin on my own node */
+        STATS_CONTENDED;
+        pred->next = me;
+        while (me->locked) pause();
+    }
+    l->owner = me;
+    smp_status(STATUS_RUNNING);
+    STATS_LOCKED(l, 0);
+}
+
+int mcslock_trylock(mcslock_t *l)
+{
+    /* 0/false: try was unsuccessful, 1/true: lock obtained successfully */
+    mcs_node_t *me = mcs_node_get();
+    STATS_BEGIN;
+
+    me->next = 0;
+    me->locked = 1;
+    if (__sync_bool_compare_and_swap(&l->tail, 0, me)) {
+        l->owner = me;
+        STATS_LOCKED(l, 0);
+        return 1;
+    }
+    mcs_node_put(me);
+    return 0;
+}
+
+void mcslock_unlock(mcslock_t *l)
+{
+    mcs_node_t *me = l->owner;
+
+    STATS_UNLOCK(l);
+    if (me->next == 0) {
+        /* no known successor: try to release the lock */
+        if (__sync_bool_compare_and_swap(&l->tail, me, 0)) {
+            mcs_node_put(me);
+            return;
+        }
+        /* a successor is just enqueueing, wait until it is linked */
+        while (me->next == 0) pause();
+    }
+    __sync_synchronize();
+    me->next->locked = 0;       /* hand over the lock */
+    mcs_node_put(me);
+}
+
+
+/*
+ * Ticket lock
+ * A waiter that is d tickets away from the head pauses d*TICKET_BACKOFF times 
+ * before it polls the lock again (the owner's line is not hammered by all waiters).
+ */
+#define TICKET_BACKOFF  32
+
+void ticketlock_init(ticketlock_t *l)
+{
+    *l = (ticketlock_t)TICKETLOCK_INITIALIZER;
+}
+
+void ticketlock_lock(ticketlock_t *l)
+{
+    unsigned ticket, dist, u;
+    STATS_BEGIN;
+
+    smp_status(STATUS_MUTEX);
+    ticket = __sync_fetch_and_add(&l->next, 1);
+    while ((dist = ticket - l->owner) != 0) {       /* overflow is no problem (unsigned difference) */
+        STATS_CONTENDED;
+        for (u = 0; u < dist * TICKET_BACKOFF; u++) pause();
+    }
+    smp_status(STATUS_RUNNING);
+    STATS_LOCKED(l, 0);
+}
+
+int ticketlock_trylock(ticketlock_t *l)
+{
+    /* 0/false: try was unsuccessful, 1/true: lock obtained successfully */
+    unsigned owner = l->owner;
+    STATS_BEGIN;
+    /* only draw a ticket, if it is served immediately */
+    if (__sync_bool_compare_and_swap(&l->next, owner, owner+1)) {
+        STATS_LOCKED(l, 0);
+        return 1;
+    }
+    return 0;
+}
+
+void ticketlock_unlock(ticketlock_t *l)
+{
+    STATS_UNLOCK(l);
+    __sync_synchronize();
+    l->owner++;         /* only the holder writes owner */
+}
+
+void rwlock_init(rwlock_t *l)
+{
+    unsigned u;
+    l->writer = 0;
+    for (u = 0; u < MAX_CPU; u++) {
+        l->reader[u].cnt = 0;
+    }
+}
+
+void rwlock_read_lock(rwlock_t *l)
+{
+    rwlock_reader_t *me = &l->reader[CPU_ID];
+    STATS_BEGIN;
+
+    /* the atomic increment is a full barrier: 'writer' is read after it */
+    if (__sync_add_and_fetch(&me->cnt, 1) > 1) {
+        /* nested read lock (a writer waits for me anyway) */
+        return;
+    }
+    if (l->writer == 0) {
+        STATS_LOCKED(l, 1);
+        return;
+    }
+    STATS_CONTENDED;
+
+    /* a writer is active or waiting: withdraw and let it go first */
+    smp_status(STATUS_MUTEX);
+    do {
+        __sync_sub_and_fetch(&me->cnt, 1);
+        wait_wake(&me->cnt);
+        wait_change(&l->writer, 1, wait_policy[WAIT_FOR_MUTEX]);
+        __sync_add_and_fetch(&me->cnt, 1);
+    } while (l->writer != 0);
+    smp_status(STATUS_RUNNING);
+    STATS_LOCKED(l, 1);
+}
+
+void rwlock_read_unlock(rwlock_t *l)
+{
+    rwlock_reader_t *me = &l->reader[CPU_ID];
+
+    __sync_sub_and_fetch(&me->cnt, 1);
+    wait_wake(&me->cnt);
+}
+
+void rwlock_write_lock(rwlock_t *l)
+{
+    unsigned u, c;
+    STATS_BEGIN;
+
+    smp_status(STATUS_MUTEX);
+    /* one writer at a time; from now on, new readers back off */
+    while (!__sync_bool_compare_and_swap(&l->writer, 0, 1)) {
+        STATS_CONTENDED;
+        wait_change(&l->writer, 1, wait_policy[WAIT_FOR_MUTEX]);
+    }
+    /* wait for the readers to drain */
+    for (u = 0; u < cpu_online; u++) {
+        while ((c = l->reader[u].cnt) != 0) {
+            STATS_CONTENDED;
+            wait_change(&l->reader[u].cnt, c, wait_policy[WAIT_FOR_MUTEX]);
+        }
+    }
+    smp_status(STATUS_RUNNING);
+    STATS_LOCKED(l, 0);
+}
+
+void rwlock_write_unlock(rwlock_t *l)
+{
+    STATS_UNLOCK(l);
+    __sync_synchronize();
+    l->writer = 0;
+    wait_wake(&l->writer);
 }
 
 
@@ -111,9 +593,12 @@ barrier_t global_barrier = BARRIER_INITIALIZER(MAX_CPU+1);
 void barrier_init(barrier_t *b, int max)
 {
     *b = (barrier_t)BARRIER_INITIALIZER(max);
+#   if SYNC_STATS
+    stats_barrier_init(b);
+#   endif
 }
 
-void barrier(barrier_t *b)
+void barrier_central(barrier_t *b)
 {
     unsigned e;
     unsigned c;
@@ -128,7 +613,6 @@ void barrier(barrier_t *b)
         printf("barrier on CPU %u at 0x%x (%u/%u)\n", my_cpu_info()->cpu_id, b, c, b->max);
     }
 
-    smp_status(STATUS_BARRIER);
     /* every participant increments the counter and gets a unique ID into c */
     if (c == b->max) {
         /* last: become master for this episode: */
@@ -138,13 +622,201 @@ void barrier(barrier_t *b)
         __sync_synchronize();
         /* and release the others by incrementing the epoch (this end the episode and start a new epoch) */
         b->epoch++;     /* overflow is no problem, because the others wait while the epoch is equal */
+        wait_wake(&b->epoch);
     } else {
         /* not last:  */
         /* wait for epoch to be incremented */
-        while (e == b->epoch) {};
+        wait_change(&b->epoch, e, wait_policy[WAIT_FOR_BARRIER]);
     }
     /* episode ends, next epoch (e+1) begins */
+}
+
+void barrier_tree(barrier_t *b)
+{
+    unsigned width = b->max;        /* number of members on the current level */
+    unsigned idx = CPU_ID;          /* my index on the current level */
+    unsigned base = 0;              /* first node of the current level */
+    unsigned nodes, members, n, e;
+    unsigned path[BARRIER_LEVELS];  /* nodes, where I arrived last (I have to release them) */
+    unsigned depth = 0;
+
+    while (width > 1) {
+        nodes = (width + BARRIER_FANIN - 1) / BARRIER_FANIN;
+        n = base + idx / BARRIER_FANIN;
+        /* the last node of a level may have less members */
+        members = (idx / BARRIER_FANIN == nodes - 1) ? width - (nodes - 1) * BARRIER_FANIN : BARRIER_FANIN;
+
+        e = b->node[n].epoch;
+        __sync_synchronize();
+        if (__sync_add_and_fetch(&(b->node[n].cnt), 1) < members) {
+            /* not last on this node: wait for its release (only the members of this node share the line) */
+            wait_change(&b->node[n].epoch, e, wait_policy[WAIT_FOR_BARRIER]);
+            break;
+        }
+        /* last on this node: reset it and climb up to the parent */
+        b->node[n].cnt = 0;
+        path[depth++] = n;
+
+        idx /= BARRIER_FANIN;
+        base += nodes;
+        width = nodes;
+    }
+
+    /* released (or arrived at the root): release the nodes I have won, top-down */
+    __sync_synchronize();
+    while (depth > 0) {
+        n = path[--depth];
+        b->node[n].epoch++;
+        wait_wake(&b->node[n].epoch);
+    }
+}
+
+/*
+ * topology-aware tree (one for all barriers over all online CPUs):
+ * for every CPU, the nodes from its leaf to the root and their number of members
+ */
+static barrier_node_t topo_node[MAX_CPU];
+static struct {
+    uint16_t node;
+    uint16_t members;
+} topo_path[MAX_CPU][BARRIER_LEVELS];
+static unsigned topo_depth[MAX_CPU];
+static unsigned topo_cpus = 0;      /* number of CPUs the tree is built for (0: none) */
+
+/* do CPUs a and b belong together on topology level 'level' (0: core, 1: package, 2: all)? */
+static int topo_same(unsigned level, unsigned a, unsigned b)
+{
+    switch (level) {
+        case 0 :
+            return topo_same_core(a, b);
+        case 1 :
+            return topo_same_package(a, b);
+        default :
+            return 1;
+    }
+}
+
+/*
+ * build the topology tree for the CPUs 0 .. cpu_online-1
+ * (called by the BSP after all APs are up and before the first barrier)
+ */
+void barrier_topo_init(void)
+{
+    unsigned item[MAX_CPU];         /* subtree (item) each CPU belongs to on the current level */
+    unsigned rep[MAX_CPU];          /* one CPU of each item (for the topology IDs) */
+    unsigned group[MAX_CPU];        /* item -> item on the next level */
+    unsigned member[BARRIER_FANIN];
+    unsigned items = cpu_online;
+    unsigned next_items, nodes = 0;
+    unsigned level, u, v, w, m, joined;
+
+    topo_cpus = 0;
+    for (u = 0; u < cpu_online; u++) {
+        item[u] = u;
+        rep[u] = u;
+        topo_depth[u] = 0;
+        topo_node[u].cnt = 0;
+    }
+
+    for (level = 0; level < 3; level++) {
+        do {
+            /* combine up to BARRIER_FANIN items of the same core/package into one node */
+            joined = 0;
+            next_items = 0;
+            for (u = 0; u < items; u++) group[u] = MAX_CPU;
+            for (u = 0; u < items; u++) {
+                if (group[u] != MAX_CPU) continue;
+                m = 0;
+                for (v = u; v < items && m < BARRIER_FANIN; v++) {
+                    if (group[v] == MAX_CPU && topo_same(level, rep[u], rep[v])) {
+                        group[v] = next_items;
+                        member[m++] = v;
+                    }
+                }
+                if (m > 1) {
+                    /* new node: add it to the path of all CPUs below it */
+                    for (w = 0; w < cpu_online; w++) {
+                        for (v = 0; v < m; v++) {
+                            if (item[w] == member[v]) break;
+                        }
+                        if (v == m) continue;
+                        if (topo_depth[w] >= BARRIER_LEVELS) return;    /* too deep: keep barrier_tree() */
+                        topo_path[w][topo_depth[w]].node = nodes;
+                        topo_path[w][topo_depth[w]].members = m;
+                        topo_depth[w]++;
+                    }
+                    nodes++;
+                    joined = 1;
+                }
+                rep[next_items++] = rep[u];
+            }
+            for (w = 0; w < cpu_online; w++) item[w] = group[item[w]];
+            items = next_items;
+        } while (joined);
+    }
+
+    IFVV for (u = 0; u < cpu_online; u++) {
+        printf("barrier_topo: CPU %u path:", u);
+        for (v = 0; v < topo_depth[u]; v++) {
+            printf(" %u(%u)", topo_path[u][v].node, topo_path[u][v].members);
+        }
+        printf("\n");
+    }
+    __sync_synchronize();
+    topo_cpus = cpu_online;
+}
+
+void barrier_topo(barrier_t *b)
+{
+    unsigned me = CPU_ID;
+    unsigned path[BARRIER_LEVELS];  /* nodes, where I arrived last (I have to release them) */
+    unsigned depth = 0;
+    unsigned l, n, e;
+
+    if (b->max != topo_cpus) {
+        /* not all online CPUs (or no tree built): use the rank based tree */
+        barrier_tree(b);
+        return;
+    }
+
+    for (l = 0; l < topo_depth[me]; l++) {
+        n = topo_path[me][l].node;
+        e = topo_node[n].epoch;
+        __sync_synchronize();
+        if (__sync_add_and_fetch(&(topo_node[n].cnt), 1) < topo_path[me][l].members) {
+            wait_change(&topo_node[n].epoch, e, wait_policy[WAIT_FOR_BARRIER]);
+            break;
+        }
+        topo_node[n].cnt = 0;
+        path[depth++] = n;
+    }
+
+    __sync_synchronize();
+    while (depth > 0) {
+        n = path[--depth];
+        topo_node[n].epoch++;
+        wait_wake(&topo_node[n].epoch);
+    }
+}
+
+void barrier(barrier_t *b)
+{
+#   if SYNC_STATS
+    sync_stats_t *s = stats_get(b);
+    unsigned e = stats_barrier_arrive(s);
+#   endif
+    smp_status(STATUS_BARRIER);
+#   if BARRIER_TYPE == 2
+    barrier_topo(b);
+#   elif BARRIER_TYPE == 1
+    barrier_tree(b);
+#   else
+    barrier_central(b);
+#   endif
     smp_status(STATUS_RUNNING);
+#   if SYNC_STATS
+    stats_barrier_leave(s, e, CPU_ID);
+#   endif
 }
 
 
@@ -156,13 +828,17 @@ void flag_init(flag_t *flag)
 void flag_signal(flag_t *flag)
 {
     __sync_add_and_fetch(&flag->flag, 1);
+    wait_wake(&flag->flag);
 }
       
 void flag_wait(flag_t *flag)
 {
     unsigned n = flag->next + 1;
+    unsigned f;
     smp_status(STATUS_FLAG);
-    while (flag->flag < n) {};
+    while ((f = flag->flag) < n) {
+        wait_change(&flag->flag, f, wait_policy[WAIT_FOR_FLAG]);
+    }
     __sync_add_and_fetch(&flag->next, 1);
     smp_status(STATUS_RUNNING);
 }
@@ -181,20 +857,21 @@ int flag_trywait(flag_t *flag)
 /*
  * collective only()
  * the CPUs not in mask go into smp_halt() until collective_end()
+ * (the CPUs are 0 .. cpu_online-1, see smp_close())
  */
 static mutex_t coll_mutex = MUTEX_INITIALIZER;
 static unsigned coll_master = 0;
-static cpumask_t coll_mask;
-unsigned collective_only(cpumask_t mask)
+static cpumask_t coll_mask = {{0}};
+unsigned collective_only(const cpumask_t *mask)
 {
     unsigned myid = my_cpu_info()->cpu_id;
-    if (mask & ((cpumask_t)1 << myid)) {
+    if (cpumask_test(mask, myid)) {
         IFVV printf("coll_only[%u]: continue\n", myid);
         /* proceed... */
         if (mutex_trylock(&coll_mutex)) {
             IFVV printf("coll_only[%u]: Master!\n", myid);
             coll_master = myid;
-            coll_mask = mask;
+            coll_mask = *mask;
         }
         return 1;
     } else {
@@ -208,10 +885,10 @@ void collective_end()
     unsigned myid = my_cpu_info()->cpu_id;
     unsigned u;
     if (coll_master == myid) {
-        IFVV printf("coll_end[%u]: Master! (mask=0x%x)\n", myid, coll_mask);
+        IFVV printf("coll_end[%u]: Master! (%u CPUs)\n", myid, cpumask_weight(&coll_mask));
         /* I'm master */
         for (u=0; u<cpu_online; u++) {
-            if ((coll_mask & ((cpumask_t)1 << u)) == 0) {
+            if (!cpumask_test(&coll_mask, u)) {
                 IFVV printf("coll_end[%u]: wake up %u\n", myid, u);
                 smp_wakeup(u);
             }
@@ -220,3 +897,160 @@ void collective_end()
     }
 
 }
+
+
+/*
+ * SPSC ring (see sync.h)
+ * On x86, stores are not reordered with other stores and loads not with other loads,
+ * so a compiler barrier is enough between copying a message and publishing the index.
+ */
+#define compiler_barrier()  __asm__ volatile ("" ::: "memory")
+
+void spsc_init(spsc_t *r, void *buf, unsigned slots, unsigned msg_size, unsigned batch)
+{
+    r->cfg.buf = buf;
+    r->cfg.mask = slots - 1;
+    r->cfg.msg_size = msg_size;
+    r->cfg.batch = (batch == 0 || batch > slots) ? 1 : batch;
+    r->p_pub.head = 0;
+    r->c_pub.tail = 0;
+    r->p.head = 0;
+    r->p.tail_cache = 0;
+    r->c.tail = 0;
+    r->c.head_cache = 0;
+}
+
+void spsc_flush_send(spsc_t *r)
+{
+    compiler_barrier();
+    r->p_pub.head = r->p.head;
+}
+
+void spsc_flush_recv(spsc_t *r)
+{
+    compiler_barrier();
+    r->c_pub.tail = r->c.tail;
+}
+
+int spsc_trysend(spsc_t *r, const void *msg)
+{
+    unsigned head = r->p.head;
+
+    if (head - r->p.tail_cache > r->cfg.mask) {
+        /* looks full: fetch the consumer's progress */
+        r->p.tail_cache = r->c_pub.tail;
+        if (head - r->p.tail_cache > r->cfg.mask) {
+            spsc_flush_send(r);     /* the consumer must see everything to make room */
+            return 0;
+        }
+    }
+    memcpy(r->cfg.buf + (head & r->cfg.mask) * r->cfg.msg_size, msg, r->cfg.msg_size);
+    r->p.head = ++head;
+    if (head - r->p_pub.head >= r->cfg.batch) spsc_flush_send(r);
+    return 1;
+}
+
+void spsc_send(spsc_t *r, const void *msg)
+{
+    while (!spsc_trysend(r, msg)) pause();
+}
+
+int spsc_tryrecv(spsc_t *r, void *msg)
+{
+    unsigned tail = r->c.tail;
+
+    if (tail == r->c.head_cache) {
+        /* looks empty: fetch the producer's progress */
+        r->c.head_cache = r->p_pub.head;
+        if (tail == r->c.head_cache) {
+            spsc_flush_recv(r);     /* give back all consumed slots */
+            return 0;
+        }
+    }
+    compiler_barrier();
+    memcpy(msg, r->cfg.buf + (tail & r->cfg.mask) * r->cfg.msg_size, r->cfg.msg_size);
+    r->c.tail = ++tail;
+    if (tail - r->c_pub.tail >= r->cfg.batch) spsc_flush_recv(r);
+    return 1;
+}
+
+void spsc_recv(spsc_t *r, void *msg)
+{
+    while (!spsc_tryrecv(r, msg)) pause();
+}
+
+
+/*
+ * MPMC queue (see sync.h)
+ */
+void mpmc_init(mpmc_t *q, mpmc_cell_t *cells, unsigned cnt)
+{
+    unsigned u;
+    q->cfg.cell = cells;
+    q->cfg.mask = cnt - 1;
+    for (u = 0; u < cnt; u++) {
+        cells[u].seq = u;
+        cells[u].data = NULL;
+    }
+    q->enq.pos = 0;
+    q->deq.pos = 0;
+    __sync_synchronize();
+}
+
+/* 1: enqueued, 0: queue full */
+int mpmc_tryenqueue(mpmc_t *q, void *data)
+{
+    mpmc_cell_t *cell;
+    unsigned pos = q->enq.pos;
+    unsigned old;
+    int dif;
+
+    while (1) {
+        cell = &q->cfg.cell[pos & q->cfg.mask];
+        dif = (int)(cell->seq - pos);
+        if (dif == 0) {
+            /* cell is free: claim position pos */
+            old = __sync_val_compare_and_swap(&q->enq.pos, pos, pos + 1);
+            if (old == pos) break;
+            pos = old;
+        } else if (dif < 0) {
+            /* cell still holds the item from one round ago */
+            return 0;
+        } else {
+            /* another producer was faster */
+            pos = q->enq.pos;
+        }
+    }
+    cell->data = data;
+    compiler_barrier();
+    cell->seq = pos + 1;
+    return 1;
+}
+
+/* 1: dequeued into *data, 0: queue empty */
+int mpmc_trydequeue(mpmc_t *q, void **data)
+{
+    mpmc_cell_t *cell;
+    unsigned pos = q->deq.pos;
+    unsigned old;
+    int dif;
+
+    while (1) {
+        cell = &q->cfg.cell[pos & q->cfg.mask];
+        dif = (int)(cell->seq - (pos + 1));
+        if (dif == 0) {
+            /* cell is filled: claim position pos */
+            old = __sync_val_compare_and_swap(&q->deq.pos, pos, pos + 1);
+            if (old == pos) break;
+            pos = old;
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = q->deq.pos;
+        }
+    }
+    *data = cell->data;
+    compiler_barrier();
+    cell->seq = pos + q->cfg.mask + 1;
+    return 1;
+}
@@ -46,6 +46,49 @@
 #define SYNC_H
 
 #include "types.h"
+#include "config.h"
+
+/*
+ * Wait policies
+ * Every blocking wait in barrier(), flag_wait() and mutex_lock() ends up in 
+ * wait_change(), which returns after *adr has changed from old, using
+ * the policy selected for the primitive in wait_policy[] (defaults: WAIT_* in config.h):
+ *  - WAIT_SPIN:    tight loop
+ *  - WAIT_PAUSE:   loop with pause (leaves the pipeline to the SMT sibling)
+ *  - WAIT_BACKOFF: exponential backoff with pause (up to WAIT_BACKOFF_MAX)
+ *  - WAIT_MWAIT:   MONITOR/MWAIT on the line of adr (WAIT_PAUSE if not supported)
+ *  - WAIT_HALT:    WAIT_HALT_SPIN pause-loops, then hlt until a wait_wake(adr) 
+ *                  sends the wake-up IPI (vector 0x80, as smp_wakeup())
+ * Whoever changes a watched word calls wait_wake() afterwards.
+ */
+typedef enum {WAIT_SPIN, WAIT_PAUSE, WAIT_BACKOFF, WAIT_MWAIT, WAIT_HALT, WAIT_CNT} wait_policy_t;
+typedef enum {WAIT_FOR_BARRIER, WAIT_FOR_FLAG, WAIT_FOR_MUTEX, WAIT_FOR_CNT} wait_for_t;
+#define WAIT_BACKOFF_MAX    1024
+#define WAIT_HALT_SPIN      1000
+extern wait_policy_t wait_policy[WAIT_FOR_CNT];
+extern char *wait_policy_name[WAIT_CNT];
+void wait_init(void);
+void wait_change(volatile unsigned *adr, unsigned old, wait_policy_t policy);
+void wait_wake(volatile unsigned *adr);
+
+/*
+ * Lock and barrier statistics (only if SYNC_STATS is set in config.h)
+ * Recorded per lock (mutex_t, mcslock_t, ticketlock_t, rwlock_t) and per barrier_t,
+ * identified by its address (the first SYNC_STATS_MAX ones are recorded):
+ *  - locks: acquisitions, contended acquisitions, total and max. spin cycles, 
+ *           max. hold time (not for read locks)
+ *  - barriers (barrier() only): episodes, avg. and max. arrival skew (first to last CPU)
+ * sync_stats_name() gives a lock a name for sync_stats_print(), which prints the 
+ * table (called at stop() and from the info menu).
+ * ATTN: the statistics themselves add some cycles to every operation.
+ */
+#define SYNC_STATS_MAX      32
+#if SYNC_STATS
+void sync_stats_name(const volatile void *adr, const char *name);
+#else
+#   define sync_stats_name(adr, name)
+#endif
+void sync_stats_print(void);
 
 typedef volatile int mutex_t;
 #define MUTEX_INITIALIZER           ((mutex_t)1)
@@ -55,16 +98,136 @@ void mutex_lock(mutex_t *m);
 void mutex_unlock(mutex_t *m);
 int mutex_trylock(mutex_t *m);
 
+/*
+ * MCS queue lock (Mellor-Crummey, Scott)
+ * Every waiter enqueues a node and spins on its own cache line,
+ * the lock is handed over in FIFO order.
+ * The nodes are taken from a per-CPU pool (cpu_info_t.mcs_node[]),
+ * so one CPU can hold up to MCS_NODES locks at the same time.
+ */
+#define MCS_NODES   4
+typedef struct mcs_node_s {
+    struct mcs_node_s * volatile next;
+    volatile unsigned locked;
+} __attribute__((aligned(CACHE_LINE))) mcs_node_t;
+
+typedef struct {
+    mcs_node_t * volatile tail;     /* last node in queue (0: free) */
+    mcs_node_t * volatile owner;    /* node of current lock holder (used by unlock) */
+} mcslock_t;
+#define MCSLOCK_INITIALIZER         { .tail=0, .owner=0 }
+void mcslock_init(mcslock_t *l);
+void mcslock_lock(mcslock_t *l);
+void mcslock_unlock(mcslock_t *l);
+int mcslock_trylock(mcslock_t *l);
+
+/*
+ * Ticket lock
+ * Waiters draw a ticket and are served in FIFO order. While waiting, they back off
+ * proportionally to their distance from the head of the queue.
+ */
+typedef struct {
+    volatile unsigned next;         /* next ticket to draw */
+    volatile unsigned owner;        /* ticket currently served */
+} ticketlock_t;
+#define TICKETLOCK_INITIALIZER      { .next=0, .owner=0 }
+void ticketlock_init(ticketlock_t *l);
+void ticketlock_lock(ticketlock_t *l);
+void ticketlock_unlock(ticketlock_t *l);
+int ticketlock_trylock(ticketlock_t *l);
+
+/*
+ * Reader-writer lock (writer-preferring, per-CPU reader indicators)
+ * A reader only increments the counter in its own cache line and checks that no
+ * writer is active or waiting, so readers on different CPUs do not share a line.
+ * A writer announces itself in 'writer' (new readers back off from then on) and 
+ * waits until all reader indicators have drained. 
+ * Read locks may be nested on a CPU; a CPU holding a read lock must not take 
+ * the write lock. The waits use wait_policy[WAIT_FOR_MUTEX].
+ */
+typedef struct {
+    volatile unsigned cnt;          /* read locks held by this CPU */
+} __attribute__((aligned(CACHE_LINE))) rwlock_reader_t;
+
+typedef struct {
+    volatile unsigned writer;       /* 1: a writer holds the lock or waits for the readers */
+    rwlock_reader_t reader[MAX_CPU];
+} rwlock_t;
+#define RWLOCK_INITIALIZER          { .writer=0 }
+void rwlock_init(rwlock_t *l);
+void rwlock_read_lock(rwlock_t *l);
+void rwlock_read_unlock(rwlock_t *l);
+void rwlock_write_lock(rwlock_t *l);
+void rwlock_write_unlock(rwlock_t *l);
+
+/*
+ * klock_t - lock type of the contended kernel locks (mutex_printf, pci_mutex)
+ * selected by KERNEL_LOCK in config.h
+ */
+#if KERNEL_LOCK == 1
+typedef mcslock_t klock_t;
+#   define KLOCK_INITIALIZER       MCSLOCK_INITIALIZER
+#   define klock_init(l)           mcslock_init(l)
+#   define klock_lock(l)           mcslock_lock(l)
+#   define klock_unlock(l)         mcslock_unlock(l)
+#   define klock_trylock(l)        mcslock_trylock(l)
+#elif KERNEL_LOCK == 2
+typedef ticketlock_t klock_t;
+#   define KLOCK_INITIALIZER       TICKETLOCK_INITIALIZER
+#   define klock_init(l)           ticketlock_init(l)
+#   define klock_lock(l)           ticketlock_lock(l)
+#   define klock_unlock(l)         ticketlock_unlock(l)
+#   define klock_trylock(l)        ticketlock_trylock(l)
+#else
+typedef mutex_t klock_t;
+#   define KLOCK_INITIALIZER       MUTEX_INITIALIZER
+#   define klock_init(l)           mutex_init(l)
+#   define klock_lock(l)           mutex_lock(l)
+#   define klock_unlock(l)         mutex_unlock(l)
+#   define klock_trylock(l)        mutex_trylock(l)
+#endif
+extern klock_t mutex_printf;    /* screen.c */
+extern klock_t pci_mutex;       /* pci.c */
+
+/*
+ * Barrier
+ * barrier() uses the algorithm selected by BARRIER_TYPE in config.h:
+ *  - barrier_central(): one counter and one epoch word for all participants
+ *  - barrier_tree(): combining tree with fan-in BARRIER_FANIN. Each node has its own
+ *                    cache line with counter and epoch (sense reversal by epoch counter);
+ *                    the last CPU arriving at a node climbs up, and the winners
+ *                    release their nodes top-down after the root is reached.
+ *  - barrier_topo():  like barrier_tree(), but the nodes follow the CPU topology in hw_info:
+ *                    SMT siblings meet first, then the cores of a package, then the packages
+ *                    (levels wider than BARRIER_FANIN are split into subtrees). The tree is
+ *                    built once by barrier_topo_init() for all online CPUs and shared by
+ *                    all barriers with max == cpu_online; other barriers use barrier_tree().
+ * For barrier_tree() and barrier_topo(), the participants must be the CPUs 0 .. max-1 
+ * (the CPU ID is used as rank in the tree).
+ */
+#define BARRIER_FANIN   4
+#define BARRIER_LEVELS  8       /* max. tree height (supports up to BARRIER_FANIN^8 CPUs) */
+#define BARRIER_NODES   (MAX_CPU/(BARRIER_FANIN-1) + BARRIER_LEVELS)     /* upper bound for tree nodes over MAX_CPU leaves */
+typedef struct {
+    volatile unsigned cnt;
+    volatile unsigned epoch;
+} __attribute__((aligned(CACHE_LINE))) barrier_node_t;
+
 typedef struct {
     volatile unsigned cnt;
     volatile unsigned epoch;
     volatile unsigned max;
+    barrier_node_t node[BARRIER_NODES];
 } barrier_t;
 //#define BARRIER_INITIALIZER(m)  (barrier_t){ .cnt=0, .epoch=0, .max=m };
 #define BARRIER_INITIALIZER(m)  { .cnt=0, .epoch=0, .max=m };
 extern barrier_t global_barrier;
 void barrier_init(barrier_t *b, int max);
 void barrier(barrier_t *b);
+void barrier_central(barrier_t *b);
+void barrier_tree(barrier_t *b);
+void barrier_topo_init(void);
+void barrier_topo(barrier_t *b);
 
 typedef struct {
     volatile unsigned flag;
@@ -77,8 +240,76 @@ void flag_signal(flag_t *flag);
 void flag_wait(flag_t *flag);
 int flag_trywait(flag_t *flag);
 
-unsigned collective_only(cpumask_t mask);
+unsigned collective_only(const cpumask_t *mask);
 void collective_end();
 
+/*
+ * Single-producer/single-consumer ring of fixed-size messages
+ * The published indices head (producer) and tail (consumer) live in separate
+ * cache lines; each side works on a private copy of the other side's index and
+ * re-reads the shared one only when the ring looks full (or empty).
+ * Both sides publish their progress in batches of 'batch' messages
+ * (spsc_flush() publishes the rest). The number of slots must be a power of 2,
+ * the buffer (slots * msg_size bytes) is provided by the caller.
+ */
+typedef struct {
+    struct {
+        char *buf;
+        unsigned mask;              /* slots - 1 */
+        unsigned msg_size;
+        unsigned batch;
+    } __attribute__((aligned(CACHE_LINE))) cfg;     /* read-only after spsc_init() */
+    struct {
+        volatile unsigned head;     /* published by the producer */
+    } __attribute__((aligned(CACHE_LINE))) p_pub;
+    struct {
+        volatile unsigned tail;     /* published by the consumer */
+    } __attribute__((aligned(CACHE_LINE))) c_pub;
+    struct {
+        unsigned head;              /* next slot to write */
+        unsigned tail_cache;        /* last seen c_pub.tail */
+    } __attribute__((aligned(CACHE_LINE))) p;       /* producer only */
+    struct {
+        unsigned tail;              /* next slot to read */
+        unsigned head_cache;        /* last seen p_pub.head */
+    } __attribute__((aligned(CACHE_LINE))) c;       /* consumer only */
+} spsc_t;
+void spsc_init(spsc_t *r, void *buf, unsigned slots, unsigned msg_size, unsigned batch);
+int spsc_trysend(spsc_t *r, const void *msg);
+void spsc_send(spsc_t *r, const void *msg);
+int spsc_tryrecv(spsc_t *r, void *msg);
+void spsc_recv(spsc_t *r, void *msg);
+void spsc_flush_send(spsc_t *r);
+void spsc_flush_recv(spsc_t *r);
+
+/*
+ * Bounded multi-producer/multi-consumer queue of pointers (D. Vyukov)
+ * Every cell carries a sequence number that tells whether it is free for the 
+ * enqueue at position pos (seq == pos) or filled for the dequeue (seq == pos+1).
+ * Producers and consumers only contend on their own position counter (CAS)
+ * and then work on distinct cells. The number of cells must be a power of 2, 
+ * the cell array is provided by the caller.
+ */
+typedef struct {
+    volatile unsigned seq;
+    void * volatile data;
+} mpmc_cell_t;
+
+typedef struct {
+    struct {
+        mpmc_cell_t *cell;
+        unsigned mask;              /* cells - 1 */
+    } __attribute__((aligned(CACHE_LINE))) cfg;     /* read-only after mpmc_init() */
+    struct {
+        volatile unsigned pos;
+    } __attribute__((aligned(CACHE_LINE))) enq;
+    struct {
+        volatile unsigned pos;
+    } __attribute__((aligned(CACHE_LINE))) deq;
+} mpmc_t;
+void mpmc_init(mpmc_t *q, mpmc_cell_t *cells, unsigned cnt);
+int mpmc_tryenqueue(mpmc_t *q, void *data);
+int mpmc_trydequeue(mpmc_t *q, void **data);
+
 #endif  // SYNC_H
 
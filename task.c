@@ -0,0 +1,249 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  task.c
+ *
+ *    Description:  work-stealing task runtime (spawn/sync, parallel_for)
+ *
+ *        Version:  1.0
+ *        Created:  17.10.2026 10:12:31
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Georg Wassen (gw) (wassen@lfbs.rwth-aachen.de), 
+ *        Company:  Lehrstuhl für Betriebssysteme (Chair for Operating Systems)
+ *                  RWTH Aachen University
+ *
+ * Copyright (c) 2011, Georg Wassen, RWTH Aachen University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * =====================================================================================
+ */
+
+#include "task.h"
+#include "smp.h"
+#include "sync.h"
+#include "cpu.h"
+#include "mm.h"
+#include "config.h"
+
+#define IFV   if (VERBOSE > 0 || VERBOSE_SYNC > 0)
+#define IFVV  if (VERBOSE > 1 || VERBOSE_SYNC > 1)
+
+extern volatile unsigned cpu_online;
+
+typedef struct {
+    task_func_t func;
+    void *arg;
+    task_group_t *group;
+} task_t;
+
+typedef struct {
+    struct {
+        volatile unsigned top;          /* next task to steal (thieves) */
+    } __attribute__((aligned(CACHE_LINE))) t;
+    struct {
+        volatile unsigned bottom;       /* next free slot (owner) */
+        unsigned seed;                  /* for the choice of victims */
+    } __attribute__((aligned(CACHE_LINE))) b;
+    task_t task[TASK_DEQUE_SIZE];
+} task_deque_t;
+
+static task_deque_t *deque = 0;         /* one per CPU online (allocated in task_run()) */
+static volatile unsigned task_workers = 0;
+static volatile unsigned task_done = 0;
+
+/* owner: push task at the bottom (0: deque full) */
+static int deque_push(task_deque_t *d, task_t *task)
+{
+    unsigned b = d->b.bottom;
+
+    if ((int)(b - d->t.top) >= TASK_DEQUE_SIZE) return 0;
+    d->task[b & (TASK_DEQUE_SIZE-1)] = *task;
+    __asm__ volatile ("" ::: "memory");     /* x86: stores stay in order */
+    d->b.bottom = b + 1;
+    return 1;
+}
+
+/* owner: pop task from the bottom (0: deque empty or the last task was stolen) */
+static int deque_pop(task_deque_t *d, task_t *task)
+{
+    unsigned b = d->b.bottom - 1;
+    unsigned t;
+    int ok = 1;
+
+    d->b.bottom = b;
+    __sync_synchronize();       /* the store to bottom must be visible before top is read */
+    t = d->t.top;
+    if ((int)(b - t) < 0) {
+        /* empty */
+        d->b.bottom = t;
+        return 0;
+    }
+    *task = d->task[b & (TASK_DEQUE_SIZE-1)];
+    if (b == t) {
+        /* last task: race against the thieves */
+        ok = __sync_bool_compare_and_swap(&d->t.top, t, t + 1);
+        d->b.bottom = t + 1;
+    }
+    return ok;
+}
+
+/* thief: take the task at the top (0: empty or lost a race) */
+static int deque_steal(task_deque_t *d, task_t *task)
+{
+    unsigned t = d->t.top;
+    unsigned b;
+
+    __asm__ volatile ("" ::: "memory");     /* x86: loads stay in order */
+    b = d->b.bottom;
+    if ((int)(b - t) <= 0) return 0;
+    *task = d->task[t & (TASK_DEQUE_SIZE-1)];
+    return __sync_bool_compare_and_swap(&d->t.top, t, t + 1);
+}
+
+static void task_execute(task_t *task)
+{
+    task->func(task->arg);
+    __sync_sub_and_fetch(&task->group->pending, 1);
+}
+
+/* execute one task: own deque first, then steal from a random victim (0: nothing found) */
+static int task_find_and_execute(unsigned myid)
+{
+    task_deque_t *d = &deque[myid];
+    task_t task;
+    unsigned u, victim;
+
+    if (deque_pop(d, &task)) {
+        task_execute(&task);
+        return 1;
+    }
+    if (task_workers < 2) return 0;
+    /* xorshift */
+    d->b.seed ^= d->b.seed << 13;
+    d->b.seed ^= d->b.seed >> 17;
+    d->b.seed ^= d->b.seed << 5;
+    victim = d->b.seed % task_workers;
+    for (u = 0; u < task_workers; u++, victim = (victim + 1) % task_workers) {
+        if (victim == myid) continue;
+        if (deque_steal(&deque[victim], &task)) {
+            task_execute(&task);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void task_spawn(task_group_t *group, task_func_t func, void *arg)
+{
+    task_t task = { .func = func, .arg = arg, .group = group };
+
+    __sync_add_and_fetch(&group->pending, 1);
+    if (!deque_push(&deque[CPU_ID], &task)) {
+        /* deque full: execute it right away */
+        task_execute(&task);
+    }
+}
+
+void task_sync(task_group_t *group)
+{
+    unsigned myid = CPU_ID;
+
+    while (group->pending > 0) {
+        if (!task_find_and_execute(myid)) pause();
+    }
+}
+
+void task_run(unsigned workers, task_func_t root, void *arg)
+{
+    unsigned myid = CPU_ID;
+
+    if (workers > cpu_online) workers = cpu_online;
+    if (workers < 1) workers = 1;
+    if (myid == 0) {
+        if (deque == 0) {
+            /* on the first call: sized for the CPUs online, never freed */
+            deque = heap_alloc((cpu_online * sizeof(task_deque_t) + PAGE_SIZE - 1) / PAGE_SIZE, 0);
+        }
+        task_workers = workers;
+        task_done = 0;
+    }
+    barrier(&global_barrier);
+    /* the heap is not cleared: every CPU resets its own (empty) deque */
+    deque[myid].t.top = 0;
+    deque[myid].b.bottom = 0;
+    deque[myid].b.seed = 0x9E3779B9 * (myid + 1);
+    barrier(&global_barrier);
+
+    if (myid == 0) {
+        root(arg);
+        task_done = 1;
+    } else if (myid < workers) {
+        while (!task_done) {
+            if (!task_find_and_execute(myid)) pause();
+        }
+    }
+    barrier(&global_barrier);
+}
+
+/*
+ * parallel_for: split the range recursively, spawn the upper half
+ */
+typedef struct {
+    unsigned from, to, grain;
+    void (*body)(unsigned i, void *arg);
+    void *arg;
+} task_range_t;
+
+static void task_range(void *p)
+{
+    task_range_t *r = (task_range_t*)p;
+    task_range_t lower, upper;
+    task_group_t group = TASK_GROUP_INITIALIZER;
+    unsigned i;
+
+    if (r->to - r->from <= r->grain) {
+        for (i = r->from; i < r->to; i++) {
+            r->body(i, r->arg);
+        }
+        return;
+    }
+    lower = *r;
+    upper = *r;
+    lower.to = upper.from = r->from + (r->to - r->from) / 2;
+    task_spawn(&group, task_range, &upper);
+    task_range(&lower);
+    task_sync(&group);
+}
+
+void task_parallel_for(unsigned from, unsigned to, unsigned grain, 
+        void (*body)(unsigned i, void *arg), void *arg)
+{
+    task_range_t r = { .from = from, .to = to, .grain = (grain ? grain : 1), .body = body, .arg = arg };
+
+    if (from >= to) return;
+    task_range(&r);
+}
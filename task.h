@@ -0,0 +1,81 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  task.h
+ *
+ *    Description:  work-stealing task runtime (spawn/sync, parallel_for)
+ *
+ *        Version:  1.0
+ *        Created:  17.10.2026 10:12:31
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Georg Wassen (gw) (wassen@lfbs.rwth-aachen.de), 
+ *        Company:  Lehrstuhl für Betriebssysteme (Chair for Operating Systems)
+ *                  RWTH Aachen University
+ *
+ * Copyright (c) 2011, Georg Wassen, RWTH Aachen University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * =====================================================================================
+ */
+
+#ifndef TASK_H
+#define TASK_H
+
+#include "types.h"
+#include "config.h"
+
+/*
+ * Work-stealing task runtime
+ *
+ * task_run() is called by all CPUs (like barrier()): CPU 0 executes the root 
+ * function, the CPUs 1 .. workers-1 steal and execute tasks until it returns.
+ * Inside, task_spawn() puts a task into the deque of the calling CPU and 
+ * task_sync() waits for all tasks of a group, executing own and stolen tasks 
+ * meanwhile (no CPU spins idle while there is work).
+ * Every CPU owns a bounded deque (Chase-Lev): the owner pushes and pops at 
+ * the bottom, thieves take from the top. If the deque is full, task_spawn()
+ * executes the task directly.
+ * The arguments (and the group) must stay valid until task_sync() returns;
+ * usually they live on the stack of the spawning function.
+ * ATTN: nested spawn/sync uses the (small) kernel stack: use a sequential cutoff.
+ */
+#define TASK_DEQUE_SIZE     256     /* power of 2 */
+
+typedef void (*task_func_t)(void *arg);
+
+typedef struct {
+    volatile unsigned pending;      /* spawned, but not finished tasks */
+} task_group_t;
+#define TASK_GROUP_INITIALIZER      { .pending=0 }
+
+void task_run(unsigned workers, task_func_t root, void *arg);
+void task_spawn(task_group_t *group, task_func_t func, void *arg);
+void task_sync(task_group_t *group);
+void task_parallel_for(unsigned from, unsigned to, unsigned grain, 
+        void (*body)(unsigned i, void *arg), void *arg);
+
+#endif  // TASK_H
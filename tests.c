@@ -45,6 +45,7 @@
 #include "system.h"
 #include "smp.h"
 #include "sync.h"
+#include "task.h"
 #include "mm.h"
 #include "cpu.h"
 #include "keyboard.h"
@@ -121,6 +122,260 @@ void tests_flag(void)
 
 }
 
+void tests_locks(void)
+{
+    unsigned myid = my_cpu_info()->cpu_id;
+    unsigned u;
+    static mutex_t mutex = MUTEX_INITIALIZER;
+    static mcslock_t mcs = MCSLOCK_INITIALIZER;
+    static mcslock_t mcs2 = MCSLOCK_INITIALIZER;
+    static ticketlock_t ticket = TICKETLOCK_INITIALIZER;
+    static volatile unsigned long counter = 0;
+
+    /* every CPU increments the counter 10000 times per lock type, no update may get lost */
+    barrier(&global_barrier);
+    for (u=0; u<10000; u++) {
+        mutex_lock(&mutex);
+        counter++;
+        mutex_unlock(&mutex);
+    }
+    barrier(&global_barrier);
+    if (myid == 0) {
+        printf("[0] mutex_t:   counter = %u (should be %u)\n", counter, 10000*cpu_online);
+        counter = 0;
+    }
+    barrier(&global_barrier);
+    for (u=0; u<10000; u++) {
+        /* nested MCS locks (two nodes of the per-CPU pool) */
+        mcslock_lock(&mcs);
+        mcslock_lock(&mcs2);
+        counter++;
+        mcslock_unlock(&mcs2);
+        mcslock_unlock(&mcs);
+    }
+    barrier(&global_barrier);
+    if (myid == 0) {
+        printf("[0] mcslock_t: counter = %u (should be %u)\n", counter, 10000*cpu_online);
+        counter = 0;
+    }
+    barrier(&global_barrier);
+    for (u=0; u<10000; u++) {
+        ticketlock_lock(&ticket);
+        counter++;
+        ticketlock_unlock(&ticket);
+    }
+    barrier(&global_barrier);
+    if (myid == 0) {
+        printf("[0] ticketlock_t: counter = %u (should be %u)\n", counter, 10000*cpu_online);
+        counter = 0;
+    }
+    barrier(&global_barrier);
+}
+
+void tests_rwlock(void)
+{
+    unsigned myid = my_cpu_info()->cpu_id;
+    unsigned u;
+    static rwlock_t rwlock = RWLOCK_INITIALIZER;
+    static volatile unsigned long shared[2] = {0, 0};
+    static volatile unsigned errors = 0;
+    static void * volatile page = NULL;
+    static ptr_t phys;
+    ptr_t p;
+
+    /* CPU 0 writes both words under the write lock, the readers must always see them equal */
+    barrier(&global_barrier);
+    for (u=0; u<10000; u++) {
+        if (myid == 0 && u % 10 == 0) {
+            rwlock_write_lock(&rwlock);
+            shared[0]++;
+            shared[1]++;
+            rwlock_write_unlock(&rwlock);
+        } else {
+            rwlock_read_lock(&rwlock);
+            rwlock_read_lock(&rwlock);      /* nested */
+            if (shared[0] != shared[1]) __sync_add_and_fetch(&errors, 1);
+            rwlock_read_unlock(&rwlock);
+            rwlock_read_unlock(&rwlock);
+        }
+    }
+    barrier(&global_barrier);
+    if (myid == 0) {
+        printf("[0] rwlock_t: %u writes, %u inconsistent reads (should be 1000, 0)\n", shared[0], errors);
+        errors = 0;
+        page = heap_alloc(1, 0);
+        phys = virt_to_phys(page);
+    }
+
+    /* concurrent page walks (shared pt_lock, per-CPU temporary mappings) */
+    barrier(&global_barrier);
+    for (u=0; u<1000; u++) {
+        p = virt_to_phys(page);
+        if (p != phys) __sync_add_and_fetch(&errors, 1);
+    }
+    barrier(&global_barrier);
+    if (myid == 0) {
+        printf("[0] virt_to_phys: %u wrong results (should be 0)\n", errors);
+        errors = 0;
+    }
+    barrier(&global_barrier);
+}
+
+void tests_spsc(void)
+{
+    unsigned myid = my_cpu_info()->cpu_id;
+    unsigned u;
+    static spsc_t ring;
+    static unsigned long buf[8*2];
+    static volatile unsigned errors = 0;
+    unsigned long msg[2];
+
+    if (cpu_online < 2) return;
+
+    /* small ring (8 slots, batches of 3): the order must be kept, nothing may get lost */
+    if (myid == 0) spsc_init(&ring, buf, 8, sizeof(msg), 3);
+    barrier(&global_barrier);
+    if (myid == 0) {
+        for (u=0; u<10000; u++) {
+            msg[0] = u;
+            msg[1] = ~u;
+            spsc_send(&ring, msg);
+        }
+        spsc_flush_send(&ring);
+    } else if (myid == 1) {
+        for (u=0; u<10000; u++) {
+            spsc_recv(&ring, msg);
+            if (msg[0] != u || msg[1] != ~(unsigned long)u) errors++;
+        }
+        printf("[1] spsc_t: %u wrong messages (should be 0)\n", errors);
+    }
+    barrier(&global_barrier);
+}
+
+void tests_mpmc(void)
+{
+    unsigned myid = my_cpu_info()->cpu_id;
+    unsigned long u;
+    static mpmc_t queue;
+    static mpmc_cell_t cells[16];
+    static volatile unsigned long sum = 0;
+    unsigned long s = 0;
+    void *data;
+
+    /* every CPU enqueues 1..1000 and dequeues 1000 items through 16 cells */
+    if (myid == 0) mpmc_init(&queue, cells, 16);
+    barrier(&global_barrier);
+    for (u=1; u<=1000; u++) {
+        while (!mpmc_tryenqueue(&queue, (void*)u)) {
+            /* full: make room */
+            if (mpmc_trydequeue(&queue, &data)) s += (unsigned long)data;
+        }
+    }
+    barrier(&global_barrier);
+    while (mpmc_trydequeue(&queue, &data)) s += (unsigned long)data;
+    __sync_add_and_fetch(&sum, s);
+    barrier(&global_barrier);
+    if (myid == 0) {
+        printf("[0] mpmc_t: sum = %u (should be %u)\n", sum, 500500*cpu_online);
+        sum = 0;
+    }
+    barrier(&global_barrier);
+}
+
+void tests_cpumask(void)
+{
+    unsigned myid = my_cpu_info()->cpu_id;
+    static cpumask_t online = {{0}};
+    cpumask_t a, b;
+    unsigned u, n = 0, errors = 0;
+
+    /* every CPU adds itself */
+    if (myid == 0) cpumask_clear(&online);
+    barrier(&global_barrier);
+    cpumask_set_atomic(&online, myid);
+    barrier(&global_barrier);
+    if (myid == 0) {
+        cpumask_for_each(u, &online) {
+            if (u != n++) errors++;
+        }
+        /* set operations across word boundaries */
+        cpumask_fill(&a, MAX_CPU - 1);
+        cpumask_clear(&b);
+        cpumask_set(&b, 0);
+        cpumask_set(&b, MAX_CPU - 1);
+        cpumask_and(&a, &a, &b);                            /* {0} */
+        if (cpumask_weight(&a) != 1 || !cpumask_test(&a, 0)) errors++;
+        cpumask_or(&a, &a, &b);                             /* {0, MAX_CPU-1} */
+        cpumask_unset(&a, 0);
+        if (cpumask_next(&a, 0) != MAX_CPU - 1) errors++;
+        cpumask_andnot(&a, &a, &b);
+        if (!cpumask_empty(&a)) errors++;
+        printf("[0] cpumask_t: %u CPUs (should be %u), %u errors\n", cpumask_weight(&online), cpu_online, errors);
+    }
+    barrier(&global_barrier);
+}
+
+static volatile unsigned tests_task_hits[1000];
+
+static void tests_task_body(unsigned i, void *arg)
+{
+    tests_task_hits[i] += (unsigned)(ptr_t)arg;
+}
+
+static void tests_task_root(void *arg)
+{
+    unsigned u, errors = 0;
+
+    for (u=0; u<1000; u++) tests_task_hits[u] = 0;
+    task_parallel_for(0, 1000, 7, tests_task_body, arg);
+    for (u=0; u<1000; u++) {
+        if (tests_task_hits[u] != 1) errors++;
+    }
+    printf("[0] task_parallel_for: %u indices not executed exactly once (should be 0)\n", errors);
+}
+
+void tests_task(void)
+{
+    /* every index must be executed exactly once, whoever steals it */
+    task_run(cpu_online, tests_task_root, (void*)1);
+}
+
+void tests_wait(void)
+{
+    unsigned myid = my_cpu_info()->cpu_id;
+    unsigned u;
+    wait_policy_t policy;
+    wait_policy_t backup[WAIT_FOR_CNT];
+    static mutex_t mutex = MUTEX_INITIALIZER;
+    static volatile unsigned long counter = 0;
+
+    /* mutex and barrier with every wait policy (mixed policies during the switch are allowed) */
+    for (u=0; u<WAIT_FOR_CNT; u++) backup[u] = wait_policy[u];
+    for (policy=0; policy<WAIT_CNT; policy++) {
+        if (myid == 0) {
+            wait_policy[WAIT_FOR_BARRIER] = policy;
+            wait_policy[WAIT_FOR_MUTEX] = policy;
+        }
+        barrier(&global_barrier);
+        for (u=0; u<1000; u++) {
+            mutex_lock(&mutex);
+            counter++;
+            mutex_unlock(&mutex);
+            if (u % 100 == 0) barrier(&global_barrier);
+        }
+        barrier(&global_barrier);
+        if (myid == 0) {
+            printf("[0] wait %s: counter = %u (should be %u)\n", wait_policy_name[policy], counter, 1000*cpu_online);
+            counter = 0;
+        }
+    }
+    barrier(&global_barrier);
+    if (myid == 0) {
+        for (u=0; u<WAIT_FOR_CNT; u++) wait_policy[u] = backup[u];
+    }
+    barrier(&global_barrier);
+}
+
 void tests_mm(void)
 {
     static barrier_t barr = BARRIER_INITIALIZER(2);
@@ -232,6 +487,84 @@ void tests_mm_reconf()
 
 }
 
+/* a huge page: aligned, physically contiguous, reconfigurable */
+void tests_mm_huge(void)
+{
+    const size_t size = (size_t)PAGE_SIZE << INDEX_BITS;   /* 2 MB (64 bit), 4 MB (32 bit) */
+    volatile uint32_t *p;
+    ptr_t phys;
+    unsigned errors = 0;
+
+    if (CPU_ID == 0) {
+        p = heap_alloc(1, MM_HUGE);
+        phys = virt_to_phys((void*)p);
+        if (((ptr_t)p & (size-1)) != 0 || (phys & (size-1)) != 0) errors++;
+        if (virt_to_phys((void*)p + size - 4) != phys + size - 4) errors++;
+        p[size/4 - 1] = 0x12345678;
+        heap_reconfig((void*)p, size, MM_CACHE_DISABLE);
+        if (p[size/4 - 1] != 0x12345678) errors++;
+        heap_reconfig((void*)p, size, 0);
+        if (virt_to_phys((void*)p + size/2) != phys + size/2) errors++;
+        printf("[0] heap_alloc(MM_HUGE) at 0x%x (phys 0x%x): %u errors (should be 0)\n", p, phys, errors);
+    }
+    barrier(&global_barrier);
+}
+
+/* buddy allocator: blocks aligned to their size, coalesced again after frame_free() */
+void tests_mm_buddy(void)
+{
+    static const unsigned orders[] = { 0, 3, INDEX_BITS, 0, 1 };
+    frame_t frames[sizeof(orders)/sizeof(orders[0])];
+    unsigned long free_before;
+    unsigned u, errors = 0;
+
+    if (CPU_ID == 0) {
+        free_before = mm_free_frames();
+        for (u = 0; u < sizeof(orders)/sizeof(orders[0]); u++) {
+            frames[u] = frame_alloc(orders[u]);
+            if (frames[u] == 0 || (frames[u] & ((1ul << orders[u]) - 1)) != 0) errors++;
+        }
+        if (mm_free_frames() + 1 + 8 + (1ul << INDEX_BITS) + 1 + 2 != free_before) errors++;
+        for (u = 0; u < sizeof(orders)/sizeof(orders[0]); u++) {
+            if (frames[u] != 0) frame_free(frames[u], orders[u]);
+        }
+        if (mm_free_frames() != free_before) errors++;
+        /* coalesced: the same blocks again */
+        if (frame_alloc(INDEX_BITS) != frames[2]) errors++;
+        frame_free(frames[2], INDEX_BITS);
+        printf("[0] frame_alloc/frame_free (%u frames free): %u errors (should be 0)\n", free_before, errors);
+    }
+    barrier(&global_barrier);
+}
+
+/* heap_free(): frames and address space are reused, over many rounds of different flags */
+void tests_mm_free(void)
+{
+    static const unsigned flags[] = { 0, MM_HUGE, MM_CACHE_DISABLE };
+    const unsigned pages = 1024;            /* 4 MB */
+    void *first[sizeof(flags)/sizeof(flags[0])];
+    volatile uint32_t *p;
+    unsigned long free_before;
+    unsigned u, k, errors = 0;
+
+    if (CPU_ID == 0) {
+        free_before = mm_free_frames();
+        for (u = 0; u < 64; u++) {
+            k = u % (sizeof(flags)/sizeof(flags[0]));
+            p = heap_alloc(pages, flags[k]);
+            p[0] = u;
+            p[pages * PAGE_SIZE / 4 - 1] = u;
+            if (p[0] != u || p[pages * PAGE_SIZE / 4 - 1] != u) errors++;
+            if (u == k) first[k] = (void*)p;
+            else if ((void*)p != first[k]) errors++;
+            heap_free((void*)p, pages);
+        }
+        if (mm_free_frames() != free_before) errors++;
+        printf("[0] heap_alloc/heap_free 64 x %u pages: %u errors (should be 0)\n", pages, errors);
+    }
+    barrier(&global_barrier);
+}
+
 void tests_ipi(void)
 {
     unsigned myid = my_cpu_info()->cpu_id;
@@ -300,6 +633,113 @@ void tests_ipi(void)
     barrier(&global_barrier);
 }
 
+static volatile unsigned long tests_call_hits[MAX_CPU];
+
+static void tests_call_count(void *arg)
+{
+    tests_call_hits[CPU_ID] += (unsigned long)(ptr_t)arg;
+}
+
+void tests_call(void)
+{
+    unsigned myid = CPU_ID;
+    unsigned u, i, if_backup, errors = 0;
+    cpumask_t mask;
+
+    if_backup = sti();      /* the targets run the calls in the IPI handler */
+    if (myid == 0) {
+        for (u = 0; u < cpu_online; u++) tests_call_hits[u] = 0;
+    }
+    barrier(&global_barrier);
+    if (myid == 0) {
+        /* all CPUs (including myself) */
+        cpumask_fill(&mask, cpu_online);
+        smp_call_function_mask(&mask, tests_call_count, (void*)1, 1);
+        for (u = 0; u < cpu_online; u++) {
+            if (tests_call_hits[u] != 1) errors++;
+        }
+        /* more calls without waiting than queue cells (and descriptors), then one waiting call */
+        u = cpu_online - 1;
+        for (i = 0; i < 2*SMP_CALL_SLOTS; i++) smp_call_function_single(u, tests_call_count, (void*)1, 0);
+        smp_call_function_single(u, tests_call_count, (void*)1, 1);
+        if (tests_call_hits[u] != 2 + 2*SMP_CALL_SLOTS) errors++;
+        printf("[0] smp_call_function: %u errors (should be 0)\n", errors);
+    }
+    barrier(&global_barrier);
+    if (!if_backup) cli();
+}
+
+static volatile unsigned tests_timer_order[3];
+static volatile unsigned tests_timer_pos;
+
+static void tests_timer_fire(void *arg)
+{
+    tests_timer_order[tests_timer_pos++] = (unsigned)(ptr_t)arg;
+}
+
+void tests_timer(void)
+{
+    ktimer_t t[3];
+    uint64_t tsc, now;
+    unsigned errors = 0;
+
+    barrier(&global_barrier);
+    if (CPU_ID == 0 && apic_timer_ok()) {
+        /* usleep() returns after (not before) the time */
+        tsc = rdtsc();
+        usleep(1000);
+        if (rdtsc() - tsc < 1000ull * hw_info.tsc_per_usec) errors++;
+
+        /* the queue fires in the order of the deadlines; a cancelled timer does not fire */
+        tests_timer_pos = 0;
+        now = rdtsc();
+        timer_add(&t[0], now + 300ull * hw_info.tsc_per_usec, tests_timer_fire, (void*)3);
+        timer_add(&t[1], now + 100ull * hw_info.tsc_per_usec, tests_timer_fire, (void*)1);
+        timer_add(&t[2], now + 200ull * hw_info.tsc_per_usec, tests_timer_fire, (void*)2);
+        timer_cancel(&t[2]);
+        timer_sleep_until(now + 500ull * hw_info.tsc_per_usec);
+        if (tests_timer_pos != 2 || tests_timer_order[0] != 1 || tests_timer_order[1] != 3) errors++;
+        printf("[0] APIC timer queue: %u errors (should be 0)\n", errors);
+    }
+    barrier(&global_barrier);
+}
+
+static volatile unsigned tests_isolate_errors = 0;
+
+void tests_isolate(void)
+{
+    cpumask_t bench;
+    unsigned long last;
+    unsigned if_backup, errors = 0;
+
+    if (cpu_online < 2 || !apic_timer_ok()) return;
+    barrier(&global_barrier);
+    if (CPU_ID == 0) {
+        tests_isolate_errors = 0;
+        cpumask_clear(&bench);
+        cpumask_set(&bench, 1);
+        irq_isolate(&bench);
+    }
+    barrier(&global_barrier);
+    if (CPU_ID == 1) {
+        /* the timer of an isolated CPU does not interrupt */
+        last = my_cpu_info()->timer_cnt;
+        if_backup = sti();
+        apic_timer_oneshot(100);
+        udelay(1000);
+        if (!if_backup) cli();
+        apic_timer_stop();
+        if (my_cpu_info()->timer_cnt != last) tests_isolate_errors++;
+    }
+    barrier(&global_barrier);
+    if (CPU_ID == 0) {
+        if (irq_unisolate() != 0) errors++;
+        errors += tests_isolate_errors;
+        printf("[0] irq_isolate: %u errors (should be 0)\n", errors);
+    }
+    barrier(&global_barrier);
+}
+
 void tests_printf(void)
 {
     if (CPU_ID == 0) {
@@ -367,11 +807,24 @@ void tests_doall(void)
     IFV printf("[%u] calling test_barrier()\n", myid);
     tests_barrier();
     tests_flag();
+    tests_locks();
+    tests_rwlock();
+    tests_spsc();
+    tests_mpmc();
+    tests_task();
+    tests_wait();
+    tests_cpumask();
 
     tests_mm();
     tests_mm_reconf();
+    tests_mm_huge();
+    tests_mm_buddy();
+    tests_mm_free();
 
     tests_ipi();
+    tests_call();
+    tests_timer();
+    tests_isolate();
 
     tests_printf();
     tests_keyboard();
@@ -385,7 +838,7 @@ void tests_menu(void)
     do {
         menu_entry_t testmenu[] = {
             {0xFFFF, "<all>"},
-            {1 << 0, "Barrier, Flag"},
+            {1 << 0, "Barrier, Flag, Locks, Wait policies"},
             {1 << 1, "Memory-Management"},
             {1 << 2, "Interprocessor Interrupts (IPI)"},
             {1 << 3, "printf"},
@@ -397,13 +850,26 @@ void tests_menu(void)
         if (t & (1 << 0)) {
             tests_barrier();
             tests_flag();
+            tests_locks();
+            tests_rwlock();
+            tests_spsc();
+            tests_mpmc();
+            tests_task();
+            tests_wait();
+            tests_cpumask();
         }
         if (t & (1 << 1)) {
             tests_mm();
             tests_mm_reconf();
+            tests_mm_huge();
+            tests_mm_buddy();
+            tests_mm_free();
         }
         if (t & (1 << 2)) {
             tests_ipi();
+            tests_call();
+            tests_timer();
+            tests_isolate();
         }
         if (t & (1 << 3)) {
             tests_printf();
@@ -44,6 +44,8 @@
 
 #include "info_struct.h"
 #include "smp.h"
+#include "cpu.h"
+#include "apic.h"
 
 void udelay(unsigned long us)
 {
@@ -59,3 +61,97 @@ void udelay(unsigned long us)
     smp_status(STATUS_RUNNING);
 }
 
+
+/*
+ * timer queue (sorted by deadline, only used by its own CPU with interrupts disabled)
+ */
+static void timer_arm(volatile cpu_info_t *info)
+{
+    if (info->timer_queue) apic_timer_at(info->timer_queue->deadline, APIC_TIMER_DEADLINE);
+    else apic_timer_stop();
+}
+
+void timer_add(ktimer_t *t, uint64_t deadline, ktimer_func_t func, void *arg)
+{
+    volatile cpu_info_t *info = my_cpu_info();
+    ktimer_t **pp;
+    unsigned if_backup = cli();
+
+    t->deadline = deadline;
+    t->func = func;
+    t->arg = arg;
+    pp = (ktimer_t**)&info->timer_queue;
+    while (*pp != 0 && (*pp)->deadline <= deadline) pp = &(*pp)->next;
+    t->next = *pp;
+    *pp = t;
+    t->queued = 1;
+    if (info->timer_queue == t) timer_arm(info);     /* new first deadline */
+
+    if (if_backup) sti();
+}
+
+void timer_cancel(ktimer_t *t)
+{
+    volatile cpu_info_t *info = my_cpu_info();
+    ktimer_t **pp;
+    unsigned if_backup = cli();
+
+    if (t->queued) {
+        pp = (ktimer_t**)&info->timer_queue;
+        while (*pp != 0 && *pp != t) pp = &(*pp)->next;
+        if (*pp == t) {
+            *pp = t->next;
+            if (pp == (ktimer_t**)&info->timer_queue) timer_arm(info);
+        }
+        t->queued = 0;
+    }
+
+    if (if_backup) sti();
+}
+
+/* called by the interrupt handler (TIMER_VECTOR) */
+void timer_interrupt(void)
+{
+    volatile cpu_info_t *info = my_cpu_info();
+    ktimer_t *t;
+
+    while ((t = info->timer_queue) != 0 && t->deadline <= rdtsc()) {
+        info->timer_queue = t->next;
+        t->queued = 0;
+        t->func(t->arg);
+    }
+    /* the next deadline (a one-shot timer may also fire a bit early: then it's the same one) */
+    if (info->timer_queue) timer_arm(info);
+}
+
+static void timer_wake(void *arg)
+{
+    *(volatile unsigned*)arg = 1;
+}
+
+void timer_sleep_until(uint64_t tsc)
+{
+    ktimer_t t;
+    volatile unsigned fired = 0;
+    unsigned if_backup;
+
+    if (!apic_timer_ok()) {
+        /* before apic_init() */
+        while (rdtsc() < tsc) ;
+        return;
+    }
+    smp_status(STATUS_HALT);
+    if_backup = cli();
+    timer_add(&t, tsc, timer_wake, (void*)&fired);
+    while (!fired) {
+        /* sti delays interrupts by one instruction: the timer interrupt is not lost before hlt */
+        __asm__ volatile ("sti; hlt; cli" ::: "memory");
+    }
+    if (if_backup) sti();
+    smp_status(STATUS_RUNNING);
+}
+
+void usleep(unsigned long us)
+{
+    timer_sleep_until(rdtsc() + (uint64_t)us * hw_info.tsc_per_usec);
+}
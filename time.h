@@ -46,6 +46,27 @@
 
 void udelay(unsigned long us);
 
+/*
+ * per-CPU timer queue on the local APIC timer (one-shot or TSC-deadline mode, see apic.h)
+ * timer_add() queues t on the calling CPU: func(arg) is called from the timer interrupt 
+ * (i.e. when interrupts are enabled) after the TSC has reached deadline.
+ * usleep() and timer_sleep_until() halt the CPU until then (udelay() spins).
+ * The periodic mode (apic_timer_periodic()) cannot be used together with the queue.
+ */
+typedef void (*ktimer_func_t)(void *arg);
+typedef struct ktimer_s {
+    uint64_t deadline;          /* TSC */
+    ktimer_func_t func;
+    void *arg;
+    struct ktimer_s *next;
+    unsigned queued;
+} ktimer_t;
+void timer_add(ktimer_t *t, uint64_t deadline, ktimer_func_t func, void *arg);
+void timer_cancel(ktimer_t *t);
+void timer_interrupt(void);
+void timer_sleep_until(uint64_t tsc);
+void usleep(unsigned long us);
+
 inline static uint64_t rdtsc(void)
 {
 	union {
@@ -48,12 +48,117 @@
 #include "config.h"
 
 
-#if MAX_CPU <= 16
-typedef unsigned short cpumask_t;
-#elif MAX_CPU <= 32
-typedef unsigned int cpumask_t;
-#elif MAX_CPU <= 64
-typedef unsigned long long cpumask_t;
-#endif
+/*
+ * cpumask_t - set of CPUs (bit u: CPU with cpu_id u)
+ * one bit per CPU in an array of words (MAX_CPU may be larger than a register),
+ * modified with the functions below (pass a pointer, the type is not scalar)
+ */
+#define CPUMASK_BITS    (8 * sizeof(unsigned long))
+#define CPUMASK_WORDS   ((MAX_CPU + CPUMASK_BITS - 1) / CPUMASK_BITS)
+typedef struct {
+    unsigned long bits[CPUMASK_WORDS];
+} cpumask_t;
+
+static inline void cpumask_clear(cpumask_t *m)
+{
+    unsigned w;
+    for (w = 0; w < CPUMASK_WORDS; w++) m->bits[w] = 0;
+}
+
+/* set the CPUs 0 .. n-1 (and clear all others) */
+static inline void cpumask_fill(cpumask_t *m, unsigned n)
+{
+    unsigned w;
+    for (w = 0; w < CPUMASK_WORDS; w++) {
+        if (n >= (w+1) * CPUMASK_BITS) m->bits[w] = ~0ul;
+        else if (n <= w * CPUMASK_BITS) m->bits[w] = 0;
+        else m->bits[w] = (1ul << (n - w * CPUMASK_BITS)) - 1;
+    }
+}
+
+static inline void cpumask_set(cpumask_t *m, unsigned cpu)
+{
+    m->bits[cpu / CPUMASK_BITS] |= 1ul << (cpu % CPUMASK_BITS);
+}
+
+static inline void cpumask_unset(cpumask_t *m, unsigned cpu)
+{
+    m->bits[cpu / CPUMASK_BITS] &= ~(1ul << (cpu % CPUMASK_BITS));
+}
+
+static inline int cpumask_test(const cpumask_t *m, unsigned cpu)
+{
+    return (m->bits[cpu / CPUMASK_BITS] >> (cpu % CPUMASK_BITS)) & 1;
+}
+
+/* atomic versions (for masks shared between CPUs) */
+static inline void cpumask_set_atomic(cpumask_t *m, unsigned cpu)
+{
+    __sync_fetch_and_or(&m->bits[cpu / CPUMASK_BITS], 1ul << (cpu % CPUMASK_BITS));
+}
+
+static inline void cpumask_unset_atomic(cpumask_t *m, unsigned cpu)
+{
+    __sync_fetch_and_and(&m->bits[cpu / CPUMASK_BITS], ~(1ul << (cpu % CPUMASK_BITS)));
+}
+
+/* set operations: r = a op b (r may be one of a or b) */
+static inline void cpumask_and(cpumask_t *r, const cpumask_t *a, const cpumask_t *b)
+{
+    unsigned w;
+    for (w = 0; w < CPUMASK_WORDS; w++) r->bits[w] = a->bits[w] & b->bits[w];
+}
+
+static inline void cpumask_or(cpumask_t *r, const cpumask_t *a, const cpumask_t *b)
+{
+    unsigned w;
+    for (w = 0; w < CPUMASK_WORDS; w++) r->bits[w] = a->bits[w] | b->bits[w];
+}
+
+static inline void cpumask_andnot(cpumask_t *r, const cpumask_t *a, const cpumask_t *b)
+{
+    unsigned w;
+    for (w = 0; w < CPUMASK_WORDS; w++) r->bits[w] = a->bits[w] & ~b->bits[w];
+}
+
+static inline int cpumask_empty(const cpumask_t *m)
+{
+    unsigned w;
+    for (w = 0; w < CPUMASK_WORDS; w++) {
+        if (m->bits[w]) return 0;
+    }
+    return 1;
+}
+
+static inline unsigned cpumask_weight(const cpumask_t *m)
+{
+    unsigned long b;
+    unsigned w, n = 0;
+    for (w = 0; w < CPUMASK_WORDS; w++) {
+        for (b = m->bits[w]; b != 0; b &= b - 1) n++;    /* no popcnt instruction (and no libgcc) */
+    }
+    return n;
+}
+
+/* first CPU in m with cpu_id >= cpu (MAX_CPU: none) */
+static inline unsigned cpumask_next(const cpumask_t *m, unsigned cpu)
+{
+    unsigned long b;
+    unsigned w;
+
+    for (w = cpu / CPUMASK_BITS; w < CPUMASK_WORDS && w * CPUMASK_BITS < MAX_CPU; w++) {
+        b = m->bits[w];
+        if (w == cpu / CPUMASK_BITS) b &= ~0ul << (cpu % CPUMASK_BITS);
+        if (b) {
+            cpu = w * CPUMASK_BITS + __builtin_ctzl(b);
+            return (cpu < MAX_CPU) ? cpu : MAX_CPU;
+        }
+    }
+    return MAX_CPU;
+}
+
+/* iterate over all CPUs in m */
+#define cpumask_for_each(cpu, m) \
+    for ((cpu) = cpumask_next((m), 0); (cpu) < MAX_CPU; (cpu) = cpumask_next((m), (cpu)+1))
 
 #endif // TYPES_H